@@ -0,0 +1,154 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <opencv/cv.h>
+
+using namespace std;
+using namespace cv;
+
+#include "log.h"
+#include "timing.h"
+#include "desc_info.h"
+#include "integral_transform.h"
+
+// checks that the fast orientation splits give bit-identical bins and weights to SplitOrientations: the AVX2 kernel
+// on random float flow, and OrientationTable on whole-pixel flow times a quantum. also times the AVX2 kernel against
+// the scalar one. run with make check, exits nonzero on a mismatch
+
+static bool Same(int a0, int a1, float am0, float am1, int b0, int b1, float bm0, float bm1)
+{
+	return a0 == b0 && a1 == b1 && memcmp(&am0, &bm0, sizeof(float)) == 0 && memcmp(&am1, &bm1, sizeof(float)) == 0;
+}
+
+// unsigned/signed and plain/thresholded descriptors, like HOF (9 bins, thresholded) and MBH/HOG (8 bins)
+static DescInfo TestDescInfo(int t)
+{
+	return DescInfo(t < 2 ? 8 : 9, t >= 2, 3, true, 0.16, t % 2 == 0);
+}
+
+static float RandomIn(float range)
+{
+	return (rand() / (float)RAND_MAX - 0.5f) * range;
+}
+
+int CheckAvx2()
+{
+	int mismatches = 0, total = 0;
+#ifdef INTEGRAL_TRANSFORM_AVX2
+	if(!HasAvx2())
+	{
+		printf("AVX2: not supported by this CPU, skipped\n");
+		return 0;
+	}
+
+	const int n = 100003; // not a multiple of 8, so the scalar tail is covered too
+	vector<float> x(n), y(n);
+	vector<int> a0(n), a1(n), b0(n), b1(n);
+	vector<float> am0(n), am1(n), bm0(n), bm1(n);
+	for(int t = 0; t < 4; t++)
+	{
+		DescInfo info = TestDescInfo(t);
+		// zero, tiny (below the threshold), diagonal and signed-zero vectors besides plain random ones
+		for(int k = 0; k < n; k++)
+		{
+			int mode = rand() % 6;
+			x[k] = mode == 0 ? 0 : RandomIn(mode == 1 ? 0.3f : 40);
+			y[k] = mode == 2 ? 0 : mode == 3 ? x[k] : RandomIn(mode == 1 ? 0.3f : 40);
+			if(mode == 4)
+			{
+				x[k] = -x[k];
+				y[k] = -0.0f;
+			}
+		}
+		SplitOrientations(info, &x[0], &y[0], n, &a0[0], &a1[0], &am0[0], &am1[0]);
+		SplitOrientationsAvx2(info, &x[0], &y[0], n, &b0[0], &b1[0], &bm0[0], &bm1[0]);
+		for(int k = 0; k < n; k++, total++)
+		{
+			if(Same(a0[k], a1[k], am0[k], am1[k], b0[k], b1[k], bm0[k], bm1[k]))
+				continue;
+			if(mismatches++ < 5)
+				printf("AVX2 mismatch at (%g, %g): %d %d %g %g vs %d %d %g %g\n", x[k], y[k], a0[k], a1[k], am0[k], am1[k],
+					b0[k], b1[k], bm0[k], bm1[k]);
+		}
+	}
+	printf("AVX2: %d mismatches of %d vectors\n", mismatches, total);
+
+	// one 240x135 flow grid, many times over
+	DescInfo info = TestDescInfo(0);
+	const int gridArea = 240*135, repeats = 300;
+	for(int k = 0; k < gridArea; k++)
+	{
+		x[k] = RandomIn(1);
+		y[k] = RandomIn(1);
+	}
+	Timer timers[2];
+	for(int avx2 = 0; avx2 < 2; avx2++)
+	{
+		timers[avx2].Start();
+		for(int r = 0; r < repeats; r++)
+		{
+			if(avx2)
+				SplitOrientationsAvx2(info, &x[0], &y[0], gridArea, &b0[0], &b1[0], &bm0[0], &bm1[0]);
+			else
+				SplitOrientations(info, &x[0], &y[0], gridArea, &a0[0], &a1[0], &am0[0], &am1[0]);
+		}
+		timers[avx2].Stop();
+	}
+	printf("AVX2: scalar %.3lf s, avx2 %.3lf s (%.1lfx) for %d splits of 240x135\n", timers[0].TotalInSeconds(),
+		timers[1].TotalInSeconds(), timers[0].TotalInSeconds() / max(timers[1].TotalInSeconds(), 1e-9), repeats);
+#else
+	printf("AVX2: not compiled in, skipped\n");
+#endif
+	return mismatches;
+}
+
+int CheckOrientationTable()
+{
+	const int n = 200000;
+	vector<short> qx(n), qy(n);
+	vector<float> x(n), y(n);
+	vector<int> a0(n), a1(n), b0(n), b1(n);
+	vector<float> am0(n), am1(n), bm0(n), bm1(n);
+	int mismatches = 0, total = 0;
+	for(int t = 0; t < 4; t++)
+	{
+		DescInfo info = TestDescInfo(t);
+		float quantum = t == 3 ? 0.1f : 0.125f;
+		OrientationTable table(info, quantum);
+		// up to 90 pixels, so entries outside the table are split the usual way, and many short vectors
+		for(int k = 0; k < n; k++)
+		{
+			qx[k] = rand() % 181 - 90;
+			qy[k] = rand() % 7 == 0 ? 0 : rand() % 181 - 90;
+			if(rand() % 5 == 0)
+			{
+				qx[k] = rand() % 5 - 2;
+				qy[k] = rand() % 5 - 2;
+			}
+			// the way the reader computes the flow
+			x[k] = qx[k] * quantum;
+			y[k] = qy[k] * quantum;
+		}
+		SplitOrientations(info, &x[0], &y[0], n, &a0[0], &a1[0], &am0[0], &am1[0]);
+		table.Split(&qx[0], &qy[0], n, &b0[0], &b1[0], &bm0[0], &bm1[0]);
+		for(int k = 0; k < n; k++, total++)
+		{
+			if(Same(a0[k], a1[k], am0[k], am1[k], b0[k], b1[k], bm0[k], bm1[k]))
+				continue;
+			if(mismatches++ < 5)
+				printf("Table mismatch at (%d, %d) * %g: %d %d %g %g vs %d %d %g %g\n", qx[k], qy[k], quantum, a0[k], a1[k],
+					am0[k], am1[k], b0[k], b1[k], bm0[k], bm1[k]);
+		}
+	}
+	printf("OrientationTable: %d mismatches of %d vectors\n", mismatches, total);
+	return mismatches;
+}
+
+int main()
+{
+	srand(1);
+	int mismatches = CheckAvx2() + CheckOrientationTable();
+	return mismatches == 0 ? 0 : 1;
+}
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstring>
 #include "diag.h"
 #include <opencv/cv.h>
 
@@ -14,13 +15,59 @@ Mat InterpolateFrom16to8(Mat src, Size afterInterpolation, double fscale = 1)
 	return dst * fscale;
 }
 
+// block-strided view over the decoder's DCT coefficients: one row of 6 8x8 blocks (4 luma, 2 chroma) per macroblock.
+// the Mat_ wraps the decoder's own buffer, which is only valid until the next decode call; Detach() takes a private copy.
+// with a ROI the view only spans the blocks of the ROI, which start at blockOrigin (macroblock-aligned) of the buffer
+struct DctCoefficientView
+{
+	static const int blockSize = 8;
+	static const int blockArea = blockSize*blockSize;
+	static const int blocksPerMacroblock = 6;
+
+	Mat_<short> coeffs;
+	int mbWidth;
+	Point blockOrigin;
+	Size BlockGridSize; // luma blocks fully inside the frame (or the ROI)
+
+	DctCoefficientView() : mbWidth(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return coeffs.empty();
+	}
+
+	const short* Block(int blk_j, int blk_i) const
+	{
+		blk_j += blockOrigin.y;
+		blk_i += blockOrigin.x;
+		const short* macroblock = coeffs[(blk_j >> 1)*mbWidth + (blk_i >> 1)];
+		return macroblock + (((blk_j & 1) << 1) | (blk_i & 1))*blockArea;
+	}
+
+	// copies only the macroblocks under the block grid, so that the copy costs as much as the ROI
+	void Detach()
+	{
+		const int mbX = blockOrigin.x >> 1, mbY = blockOrigin.y >> 1;
+		const int mbCols = (BlockGridSize.width + 1) >> 1, mbRows = (BlockGridSize.height + 1) >> 1;
+		Mat_<short> detached(mbRows*mbCols, coeffs.cols);
+		for(int mb_y = 0; mb_y < mbRows; mb_y++)
+			memcpy(detached[mb_y*mbCols], coeffs[(mbY + mb_y)*mbWidth + mbX], sizeof(short)*mbCols*coeffs.cols);
+		coeffs = detached;
+		mbWidth = mbCols;
+		blockOrigin = Point(0, 0);
+	}
+};
+
 struct Frame
 {
 	Mat_<float> Dx, WarpDx;
 	Mat_<float> Dy, WarpDy;
-	Mat dctMap;
+	DctCoefficientView dctCoefficients;
     Mat spatialVarianceMap;
     Mat dcMap;
+    Mat dcImage; // DC-coefficient luma thumbnail, only kept for compressed-domain HOG
     Mat verticalVarianceMap;
     Mat horizontalVarianceMap;
 	Mat_<bool> Missing;
@@ -28,15 +75,20 @@ struct Frame
 	Mat RawImage;
 	int FrameIndex;
 	int64_t PTS;
+	int Span; // number of source frames this frame stands for (more than one when frames were dropped before it)
 	bool NoMotionVectors;
 	char PictType;
+	bool DctOfPicture; // coefficients transform the picture itself in every block, not a prediction residual
+	float FlowQuantum; // Dx/Dy are whole-pixel motion vectors times this, 0 when they aren't (resized, replayed)
 
 	Frame(int frameIndex, Mat dx, Mat dy, Mat missing)
-		: FrameIndex(frameIndex), Dx(dx), Dy(dy), Missing(missing), NoMotionVectors(false), PTS(-1), PictType('?')
+		: FrameIndex(frameIndex), Dx(dx), Dy(dy), Missing(missing), NoMotionVectors(false), PTS(-1), Span(1), PictType('?'),
+		DctOfPicture(false), FlowQuantum(0)
 	{
 	}
 
-	Frame(int frameIndex = -1) : FrameIndex(frameIndex), NoMotionVectors(true), PTS(-1), PictType('?')
+	Frame(int frameIndex = -1) : FrameIndex(frameIndex), NoMotionVectors(true), PTS(-1), Span(1), PictType('?'),
+		DctOfPicture(false), FlowQuantum(0)
 	{
 	}
 
@@ -45,11 +97,13 @@ struct Frame
 		return Frame(frameIndex);
 	}
 
-	void Interpolate(Size afterInterpolation, double fscale)
+	// the reader normally delivers the flow scaled and at its final grid size, then only the raw image is touched
+	void Interpolate(Size afterInterpolation, double fscale = 1)
 	{
-		if(!NoMotionVectors)
+		if(!NoMotionVectors && (Dx.size() != afterInterpolation || fscale != 1))
 		{
 			TIMERS.InterpolationHOFMBH.Start();
+			FlowQuantum = 0;
 			Dx = InterpolateFrom16to8(Dx, afterInterpolation, fscale);
 			Dy = InterpolateFrom16to8(Dy, afterInterpolation, fscale);
 
@@ -62,7 +116,15 @@ struct Frame
 			TIMERS.InterpolationHOFMBH.Stop();
 		}
 
-		if(RawImage.data)
+		// compressed-domain HOG: the DC thumbnail stands in for the raw image
+		if(RawImage.empty() && dcImage.data)
+		{
+			TIMERS.InterpolationHOG.Start();
+			resize(dcImage, RawImage, afterInterpolation);
+			TIMERS.InterpolationHOG.Stop();
+		}
+		// single-channel raw images already come at the target size from the reader
+		else if(RawImage.data && (RawImage.channels() != 1 || RawImage.size() != afterInterpolation))
 		{
 			TIMERS.InterpolationHOG.Start();
 			Mat rawImageResized;
@@ -73,6 +135,49 @@ struct Frame
 	}
 };
 
+// anything that hands out Frames in presentation order: the decoder, or a replayed feature cache
+struct FrameSource
+{
+	Size OriginalFrameSize;
+	Size DownsampledFrameSize; // macroblock grid
+	Size FlowGridSize; // size of Frame::Dx/Dy/Missing
+	int flowGridStep; // pixels per flow grid cell, 16 (one cell per macroblock) or 8
+	Rect Roi; // pixels of the original frame the frames cover, macroblock-aligned; the whole frame without -roi
+	int FrameCount;
+	double ptsPerFrame;
+	bool DetachDctCoefficients; // set when frames outlive the next Read(), e.g. on the decode-ahead thread
+
+	FrameSource() : flowGridStep(16), FrameCount(0), ptsPerFrame(1), DetachDctCoefficients(false)
+	{
+	}
+
+	// flow grid cells covered by the w x h block centered at (x, y), clamped into the grid. on the macroblock grid a
+	// block only covers the cell of its center, so that partitions of one macroblock don't spill into the next
+	Rect FlowCellsOfBlock(int x, int y, int w, int h)
+	{
+		if(flowGridStep == 16)
+			w = h = 1;
+		else
+		{
+			x -= w/2;
+			y -= h/2;
+		}
+		int j0 = max(0, min(x / flowGridStep, FlowGridSize.width-1));
+		int i0 = max(0, min(y / flowGridStep, FlowGridSize.height-1));
+		int j1 = max(0, min((x + w - 1) / flowGridStep, FlowGridSize.width-1));
+		int i1 = max(0, min((y + h - 1) / flowGridStep, FlowGridSize.height-1));
+		return Rect(j0, i0, j1 - j0 + 1, i1 - i0 + 1);
+	}
+
+	virtual Frame Read() = 0;
+	// positions the source so that the next frames include pts, returns false when that isn't possible
+	virtual bool SeekToPts(int64_t pts) = 0;
+
+	virtual ~FrameSource()
+	{
+	}
+};
+
 void PrintIntegerArray(Mat& m)
 {
 	int* ptr_m = m.ptr<int>();
@@ -82,12 +187,12 @@ void PrintIntegerArray(Mat& m)
 	}
 }
 
-void PrintFloatArray(Mat& m)
+void PrintFloatArray(Mat& m, FILE* out = stdout)
 {
 	float* ptr_m = m.ptr<float>();
 	for(int i = 0; i < m.size().area(); i++)
 	{
-		printf("%.6f\t", ptr_m[i]);
+		fprintf(out, "%.6f\t", ptr_m[i]);
 	}
 }
 
@@ -0,0 +1,129 @@
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+#include "common.h"
+#include "frame_reader.h"
+#include "diag.h"
+
+using namespace std;
+
+#ifndef __DECODE_AHEAD_H__
+#define __DECODE_AHEAD_H__
+
+// single-producer single-consumer ring of decoded frames. one slot is kept empty to tell "full" from "empty",
+// so a queue of depth n holds n+1 slots. head is only written by the consumer, tail only by the producer.
+struct FrameQueue
+{
+	vector<Frame> slots;
+	volatile int head;
+	volatile int tail;
+
+	FrameQueue(int depth) : slots(depth + 1), head(0), tail(0)
+	{
+	}
+
+	bool TryPush(const Frame& frame)
+	{
+		int next = (tail + 1) % slots.size();
+		if(next == head)
+			return false;
+
+		__sync_synchronize(); // the consumer has to be done with the slot before we overwrite it
+		slots[tail] = frame;
+		__sync_synchronize(); // publish the frame before moving the tail
+		tail = next;
+		return true;
+	}
+
+	bool TryPop(Frame& frame)
+	{
+		if(head == tail)
+			return false;
+
+		__sync_synchronize();
+		frame = slots[head];
+		slots[head] = Frame(); // drop our reference to the frame's buffers right away
+		__sync_synchronize();
+		head = (head + 1) % slots.size();
+		return true;
+	}
+};
+
+// runs FrameSource::Read on its own thread, so that decoding of the next frames overlaps with descriptor computation
+// on the current one. with depth == 0 it is a plain pass-through to the reader.
+struct DecodeAheadReader
+{
+	FrameSource& rdr;
+	FrameQueue queue;
+	pthread_t producer;
+	bool running;
+	bool finished;
+	volatile bool stopRequested;
+	Diag* diag; // the consumer's, the producer counts its decoding into it
+
+	DecodeAheadReader(FrameSource& rdr, int depth)
+		: rdr(rdr), queue(max(depth, 1)), running(false), finished(false), stopRequested(false), diag(&TIMERS)
+	{
+		if(depth > 0)
+		{
+			rdr.DetachDctCoefficients = true;
+			if(pthread_create(&producer, NULL, ProducerLoop, this) != 0)
+				throw std::runtime_error("Couldn't start decode-ahead thread");
+			running = true;
+		}
+	}
+
+	static void* ProducerLoop(void* arg)
+	{
+		DecodeAheadReader* self = (DecodeAheadReader*)arg;
+		UseDiag(self->diag);
+		while(!self->stopRequested)
+		{
+			Frame frame = self->rdr.Read();
+			while(!self->queue.TryPush(frame))
+			{
+				if(self->stopRequested)
+					return NULL;
+				sched_yield();
+			}
+
+			if(frame.PTS == -1)
+				break;
+		}
+		return NULL;
+	}
+
+	Frame Read()
+	{
+		if(!running)
+			return rdr.Read();
+
+		if(finished)
+			return Frame::Null(-1);
+
+		Frame frame;
+		if(!queue.TryPop(frame))
+		{
+			TIMERS.DecodeAheadWaiting.Start();
+			while(!queue.TryPop(frame))
+				sched_yield();
+			TIMERS.DecodeAheadWaiting.Stop();
+		}
+
+		if(frame.PTS == -1)
+			finished = true;
+		return frame;
+	}
+
+	~DecodeAheadReader()
+	{
+		if(running)
+		{
+			stopRequested = true;
+			pthread_join(producer, NULL);
+		}
+	}
+};
+
+#endif
@@ -6,6 +6,7 @@
 #ifndef __DIAG_H__
 #define __DIAG_H__
 
+// every timer and counter is listed in Merge as well, add new ones there too
 struct Diag
 {
 	Timer HogComputation;
@@ -18,6 +19,8 @@ struct Diag
 
 	Timer InterpolationHOFMBH;
 	Timer InterpolationHOG;
+	Timer GlobalMotionEstimation;
+	Timer SaliencyPruning;
 
 	Timer DescriptorComputation;
 	Timer DescriptorQuerying;
@@ -30,23 +33,50 @@ struct Diag
     Timer VerticalVarianceQuerying;
     Timer HorizontalVarianceQuerying;
 
-	Timer Everything;
+	Timer Everything; // wall-clock
 	Timer Reading;
-	Timer ReadingAndDecoding;
+	Timer ReadingAndDecoding; // on the decode-ahead thread when there is one
+	Timer DecodeAheadWaiting; // wall-clock the frame loop spent waiting for decoded frames
 	Timer Writing;
 
 	int CallsComputeDescriptor;
 	int SkippedFrames;
+	int PrunedPatches;
+	double ParallelWriting; // part of Writing done by merged threads (seconds), overlapped with the wall-clock total
 
-	Diag() : CallsComputeDescriptor(0), SkippedFrames(0) {}
+	Diag() : Everything(CLOCK_MONOTONIC), DecodeAheadWaiting(CLOCK_MONOTONIC), CallsComputeDescriptor(0), SkippedFrames(0),
+		PrunedPatches(0), ParallelWriting(0) {}
+
+	// adds up what another thread counted, e.g. a shard after its join. Everything stays the caller's wall-clock time
+	void Merge(const Diag& other)
+	{
+		static Timer Diag::* const timers[] = {
+			&Diag::HogComputation, &Diag::HofComputation, &Diag::MbhComputation, &Diag::SpatialVarianceComputation,
+			&Diag::DcComputation, &Diag::VerticalVarianceComputation, &Diag::HorizontalVarianceComputation,
+			&Diag::InterpolationHOFMBH, &Diag::InterpolationHOG, &Diag::GlobalMotionEstimation, &Diag::SaliencyPruning,
+			&Diag::DescriptorComputation, &Diag::DescriptorQuerying, &Diag::HofQuerying, &Diag::MbhQuerying,
+			&Diag::HogQuerying, &Diag::SpatialVarianceQuerying, &Diag::DcQuerying, &Diag::VerticalVarianceQuerying,
+			&Diag::HorizontalVarianceQuerying, &Diag::Reading, &Diag::ReadingAndDecoding, &Diag::DecodeAheadWaiting,
+			&Diag::Writing};
+		for(int k = 0; k < sizeof(timers) / sizeof(timers[0]); k++)
+			(this->*timers[k]).total += (other.*timers[k]).total;
+		ParallelWriting += other.Writing.total;
+
+		CallsComputeDescriptor += other.CallsComputeDescriptor;
+		SkippedFrames += other.SkippedFrames;
+		PrunedPatches += other.PrunedPatches;
+	}
 
 	void Print(int frameCount)
 	{
 		log("Reading (sec):\t%.2lf", Reading.TotalInSeconds());
 		log("Decoding (sec):\t%.2lf", ReadingAndDecoding.TotalInSeconds() - Reading.TotalInSeconds());
+		log("DecodeAhead.Waiting (wall, sec):\t%.2lf", DecodeAheadWaiting.TotalInSeconds());
 
         log("Interp (sec):\t%.2lf", InterpolationHOFMBH.TotalInSeconds() + InterpolationHOG.TotalInSeconds());
 		log("Interp.HOFMBH (sec):\t%.2lf", InterpolationHOFMBH.TotalInSeconds());
+		log("GlobalMotion (sec):\t%.2lf", GlobalMotionEstimation.TotalInSeconds());
+		log("Saliency (sec):\t%.2lf", SaliencyPruning.TotalInSeconds());
 		
 		log("IntHist (sec):\t%.2lf", DescriptorComputation.TotalInSeconds());
 		log("IntHist.HOG (sec):\t%.2lf", HogComputation.TotalInSeconds());
@@ -70,15 +100,33 @@ struct Diag
 
 		log("Writing (sec):\t%.2lf", Writing.TotalInSeconds());
 
-		double totalWithoutWriting = Everything.TotalInSeconds() - Writing.TotalInSeconds();
-		log("Total (sec):\t%.2lf", totalWithoutWriting);
-		log("Total (with writing, sec):\t%.2lf", Everything.TotalInSeconds());
+		// shards write while the others compute, so only the writing of the calling thread comes off the wall clock
+		double totalWithoutWriting = Everything.TotalInSeconds() - (Writing.TotalInSeconds() - ParallelWriting);
+		log("Total (wall, sec):\t%.2lf", totalWithoutWriting);
+		log("Total (wall, with writing, sec):\t%.2lf", Everything.TotalInSeconds());
 
 		log("Fps:\t%.2lf", frameCount / totalWithoutWriting);
 		log("Calls.ComputeDescriptor:\t%d", CallsComputeDescriptor);
 		log("Frames:\t%d", frameCount);
 		log("Frames.Skipped:\t%d", SkippedFrames);
+		log("Patches.Pruned:\t%d", PrunedPatches);
 	}
-} TIMERS;
+} mainThreadDiag;
+
+// the Diag the calling thread counts into. threads that run alongside others (shards and their decode-ahead
+// threads) get their own with UseDiag, which are merged after the join. all other threads count into mainThreadDiag
+static __thread Diag* threadDiag = NULL;
+
+inline Diag& CurrentDiag()
+{
+	return threadDiag ? *threadDiag : mainThreadDiag;
+}
+
+inline void UseDiag(Diag* diag)
+{
+	threadDiag = diag;
+}
+
+#define TIMERS CurrentDiag()
 
 #endif
@@ -0,0 +1,210 @@
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "frame_reader.h"
+#include "histogram_buffer.h"
+#include "rbh.h"
+#include "decode_ahead.h"
+#include "feature_cache.h"
+#include "global_motion.h"
+
+using namespace std;
+using namespace cv;
+
+#ifndef __EXTRACTION_H__
+#define __EXTRACTION_H__
+
+// open ends of a pts range
+static const int64_t minPts = numeric_limits<int64_t>::min();
+static const int64_t maxPts = numeric_limits<int64_t>::max();
+
+// what the frame loop needs besides its reader, Rbh and histogram buffer
+struct ExtractionSettings
+{
+	Size frameSizeAfterInterpolation;
+	int cellSize;
+	int frameCount;
+	vector<Size> patchSizes;
+	bool dense;
+	bool trackDcImage;
+	bool rbhMaps; // some channel (or the cache) needs the Rbh maps
+	bool compensateCameraMotion; // HOF/MBH from the flow minus a global affine motion model
+	int decodeAheadDepth;
+	FeatureCacheWriter* cache; // NULL unless the frames are also written to a feature cache
+};
+
+// closes the slices the frames so far have completed, and prints the windows that end with them
+void CloseSlices(HofMbhBuffer& buffer, ExtractionSettings& settings, bool emit)
+{
+	while(true)
+	{
+		TIMERS.DescriptorComputation.Start();
+		bool closed = buffer.CloseSlice();
+		TIMERS.DescriptorComputation.Stop();
+		if(!closed)
+			break;
+
+		if(buffer.AreDescriptorsReady)
+		{
+			if(emit)
+			{
+				for(int k = 0; k < settings.patchSizes.size(); k++)
+				{
+					int blockWidth = settings.patchSizes[k].width / settings.cellSize;
+					int blockHeight = settings.patchSizes[k].height / settings.cellSize;
+					int xStride = settings.dense ? 1 : blockWidth / 2;
+					int yStride = settings.dense ? 1 : blockHeight / 2;
+					buffer.PrintFullDescriptor(blockWidth, blockHeight, xStride, yStride, settings.frameCount);
+				}
+			}
+			buffer.t += (double)buffer.tStep / buffer.tStride;
+		}
+	}
+}
+
+// runs decoded frames through Rbh and the histogram buffer until the reader runs out or passes lastPts. frames before
+// processFromPts are decoded but ignored, and descriptors are printed only from emitFromPts on: the frames in between
+// just fill the temporal window
+void ExtractDescriptors(DecodeAheadReader& frames, Rbh& rbh, HofMbhBuffer& buffer, ExtractionSettings& settings,
+	int64_t processFromPts, int64_t emitFromPts, int64_t lastPts)
+{
+	while(true)
+	{
+		Frame frame = frames.Read();
+		if(frame.PTS == -1)
+			break;
+
+		log("#read frame pts=%d, mvs=%s, type=%c", frame.PTS, frame.NoMotionVectors ? "no" : "yes", frame.PictType);
+
+		if(frame.PTS > lastPts)
+			break;
+		if(frame.PTS < processFromPts)
+			continue;
+
+		TIMERS.DescriptorComputation.Start();
+
+		if(frame.NoMotionVectors)
+		{
+			// I-frames still refresh the DC thumbnail
+			if(settings.rbhMaps && (rbh.TrackDcImage || settings.cache))
+				rbh.Update(frame);
+			if(settings.cache)
+				settings.cache->Write(frame);
+
+			// only the frames dropped before it, the I-frame itself doesn't count without -dropb either
+			buffer.AddSkippedFrames(frame.Span - 1);
+			TIMERS.DescriptorComputation.Stop();
+			CloseSlices(buffer, settings, frame.PTS >= emitFromPts);
+			TIMERS.SkippedFrames++;
+			continue;
+		}
+
+		if(settings.rbhMaps)
+			rbh.Update(frame);
+		if(settings.cache)
+			settings.cache->Write(frame);
+		if(settings.compensateCameraMotion)
+			GlobalMotionEstimator().Compensate(frame);
+		frame.Interpolate(settings.frameSizeAfterInterpolation);
+		buffer.Update(frame);
+		TIMERS.DescriptorComputation.Stop();
+
+		CloseSlices(buffer, settings, frame.PTS >= emitFromPts);
+	}
+}
+
+// a run of whole GOPs extracted on its own thread, with its own reader and buffer, into its own temporary file
+struct GopShard
+{
+	int64_t processFromPts, emitFromPts, lastPts;
+	FrameReader* rdr;
+	HofMbhBuffer* buffer;
+	ExtractionSettings* settings;
+	pthread_t thread;
+	Diag diag; // what the shard's threads counted, merged into the caller's after the join
+
+	static void* Run(void* arg)
+	{
+		GopShard* shard = (GopShard*)arg;
+		UseDiag(&shard->diag);
+		Rbh rbh(shard->settings->trackDcImage);
+		DecodeAheadReader frames(*shard->rdr, shard->settings->decodeAheadDepth);
+		ExtractDescriptors(frames, rbh, *shard->buffer, *shard->settings, shard->processFromPts, shard->emitFromPts, shard->lastPts);
+		return NULL;
+	}
+};
+
+// splits [firstPts, lastPts] at keyframes into up to nShards runs of GOPs with about the same number of GOPs each and
+// extracts them in parallel. every shard but the first starts decoding ntCells*tStride frames before its first GOP, so
+// that its temporal window is full by the time it starts printing. the output is written in pts order
+void ExtractDescriptorsSharded(FrameReader& rdr, string videoPath, FrameReaderSettings readerSettings, HofMbhBuffer& prototype,
+	ExtractionSettings& settings, int nShards, int64_t firstPts, int64_t lastPts)
+{
+	vector<int64_t> keyframes = rdr.ScanKeyframePts();
+	vector<int64_t> cuts;
+	for(int i = 0; i < keyframes.size(); i++)
+		if(keyframes[i] > firstPts && keyframes[i] <= lastPts)
+			cuts.push_back(keyframes[i]);
+	nShards = max(1, min<int>(nShards, cuts.size() + 1));
+	log("Keyframes:\t%d", (int)keyframes.size());
+	log("Shards:\t%d", nShards);
+
+	int64_t warmup = (int64_t)ceil(prototype.ntCells * prototype.tStride * rdr.ptsPerFrame);
+	int64_t origin = firstPts != minPts ? firstPts : rdr.StartPts();
+
+	vector<GopShard> shards(nShards);
+	for(int s = 0; s < nShards; s++)
+	{
+		GopShard& shard = shards[s];
+		shard.emitFromPts = s == 0 ? firstPts : cuts[s*(cuts.size() + 1)/nShards - 1];
+		shard.processFromPts = s == 0 ? firstPts : max(firstPts, shard.emitFromPts - warmup);
+		shard.settings = &settings;
+
+		// readers are opened one after another here, libavformat/libavcodec setup is not thread-safe
+		shard.rdr = new FrameReader(videoPath, readerSettings);
+		if(rdr.LumaRawImages)
+			shard.rdr->ReadLumaImagesAt(rdr.RawImageSize);
+		if(shard.processFromPts != minPts && !shard.rdr->SeekToPts(shard.processFromPts))
+			log("Shard %d: seeking to pts=%d failed, decoding from the start", s, (int)shard.processFromPts);
+
+		shard.buffer = prototype.CloneConfiguration();
+		shard.buffer->out = tmpfile();
+		if(shard.buffer->out == NULL)
+			throw std::runtime_error("Couldn't create temporary file for shard output");
+		// continue the time axis of a sequential run (approximately, GOP boundaries don't line up with cells)
+		if(s > 0)
+			shard.buffer->t += (shard.processFromPts - origin) / rdr.ptsPerFrame / prototype.tStride;
+	}
+	for(int s = 0; s < nShards; s++)
+		shards[s].lastPts = s + 1 < nShards ? shards[s+1].emitFromPts - 1 : lastPts;
+
+	for(int s = 0; s < nShards; s++)
+		if(pthread_create(&shards[s].thread, NULL, GopShard::Run, &shards[s]) != 0)
+			throw std::runtime_error("Couldn't start shard thread");
+
+	char chunk[1 << 16];
+	for(int s = 0; s < nShards; s++)
+	{
+		pthread_join(shards[s].thread, NULL);
+		TIMERS.Merge(shards[s].diag);
+
+		TIMERS.Writing.Start();
+		FILE* shardOut = shards[s].buffer->out;
+		rewind(shardOut);
+		size_t read;
+		while((read = fread(chunk, 1, sizeof(chunk), shardOut)) > 0)
+			fwrite(chunk, 1, read, stdout);
+		fclose(shardOut);
+		TIMERS.Writing.Stop();
+
+		delete shards[s].buffer;
+		delete shards[s].rdr;
+	}
+}
+
+#endif
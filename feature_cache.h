@@ -0,0 +1,222 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "common.h"
+#include "diag.h"
+#include "frame_reader.h"
+#include <opencv/cv.h>
+
+using namespace std;
+using namespace cv;
+
+#ifndef __FEATURE_CACHE_H__
+#define __FEATURE_CACHE_H__
+
+// binary cache of the compressed-domain features of a video: everything FrameReader::Read() returns except pixels,
+// with the DCT coefficients replaced by the four Rbh block maps. the file is a FeatureCacheHeader followed by one
+// chunk per frame: a CachedFrameHeader, then Dx, Dy and the motion texture (floats on the flow grid), the spatial
+// variance, dc, vertical and horizontal variance maps (floats on the block grid, when present) and Missing (bytes on
+// the flow grid). chunks are padded to 8 bytes so the floats of a mapped file can be used in place. native byte order.
+static const char featureCacheMagic[8] = {'C', 'D', 'F', 'C', 'A', 'C', 'H', 'E'};
+static const int32_t featureCacheVersion = 1;
+
+struct FeatureCacheHeader
+{
+	char magic[8];
+	int32_t version;
+	int32_t frameCount;
+	int32_t originalWidth, originalHeight;
+	int32_t downsampledWidth, downsampledHeight;
+	int32_t flowWidth, flowHeight;
+	double ptsPerFrame;
+};
+
+struct CachedFrameHeader
+{
+	int32_t chunkSize; // whole chunk including this header and padding
+	int32_t frameIndex;
+	int64_t pts;
+	int32_t span;
+	int32_t flowRows, flowCols;
+	char pictType;
+	char noMotionVectors;
+	char dctOfPicture;
+	char reserved;
+	int32_t mapRows, mapCols; // 0 when the Rbh maps weren't computed
+};
+
+static const int cachedRbhMaps = 4;
+
+struct FeatureCacheWriter
+{
+	FILE* file;
+
+	FeatureCacheWriter(string path, FrameSource& source)
+	{
+		file = fopen(path.c_str(), "wb");
+		if(file == NULL)
+			throw std::runtime_error("Couldn't create feature cache: " + path);
+
+		FeatureCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, featureCacheMagic, sizeof(header.magic));
+		header.version = featureCacheVersion;
+		header.frameCount = source.FrameCount;
+		header.originalWidth = source.OriginalFrameSize.width;
+		header.originalHeight = source.OriginalFrameSize.height;
+		header.downsampledWidth = source.DownsampledFrameSize.width;
+		header.downsampledHeight = source.DownsampledFrameSize.height;
+		header.flowWidth = source.FlowGridSize.width;
+		header.flowHeight = source.FlowGridSize.height;
+		header.ptsPerFrame = source.ptsPerFrame;
+		fwrite(&header, sizeof(header), 1, file);
+	}
+
+	static int Padding(int size)
+	{
+		return (8 - size % 8) % 8;
+	}
+
+	void WriteFloats(const Mat& m)
+	{
+		Mat continuous = m.isContinuous() ? m : m.clone();
+		fwrite(continuous.ptr<float>(), sizeof(float), continuous.total(), file);
+	}
+
+	// call after Rbh::Update, so that the block maps are set
+	void Write(Frame& frame)
+	{
+		Mat* maps[cachedRbhMaps] = {&frame.spatialVarianceMap, &frame.dcMap, &frame.verticalVarianceMap, &frame.horizontalVarianceMap};
+		bool hasMaps = true;
+		for(int k = 0; k < cachedRbhMaps; k++)
+			hasMaps = hasMaps && !maps[k]->empty() && maps[k]->size() == frame.dcMap.size();
+
+		CachedFrameHeader header;
+		memset(&header, 0, sizeof(header));
+		header.frameIndex = frame.FrameIndex;
+		header.pts = frame.PTS;
+		header.span = frame.Span;
+		header.flowRows = frame.Dx.rows;
+		header.flowCols = frame.Dx.cols;
+		header.pictType = frame.PictType;
+		header.noMotionVectors = frame.NoMotionVectors;
+		header.dctOfPicture = frame.DctOfPicture;
+		header.mapRows = hasMaps ? frame.dcMap.rows : 0;
+		header.mapCols = hasMaps ? frame.dcMap.cols : 0;
+
+		int flowArea = header.flowRows * header.flowCols;
+		int mapArea = header.mapRows * header.mapCols;
+		int size = sizeof(header) + sizeof(float) * (3*flowArea + cachedRbhMaps*mapArea) + flowArea;
+		header.chunkSize = size + Padding(size);
+
+		fwrite(&header, sizeof(header), 1, file);
+		WriteFloats(frame.Dx);
+		WriteFloats(frame.Dy);
+		if(frame.motionTextureMap.size() == frame.Dx.size())
+			WriteFloats(frame.motionTextureMap);
+		else
+			WriteFloats(Mat::zeros(frame.Dx.size(), CV_32FC1));
+		for(int k = 0; k < cachedRbhMaps && hasMaps; k++)
+			WriteFloats(*maps[k]);
+		Mat missing = frame.Missing.isContinuous() ? Mat(frame.Missing) : frame.Missing.clone();
+		fwrite(missing.ptr(), 1, flowArea, file);
+
+		const char zeros[8] = {0};
+		fwrite(zeros, 1, Padding(size), file);
+	}
+
+	~FeatureCacheWriter()
+	{
+		fclose(file);
+	}
+};
+
+// replays a feature cache through the FrameSource interface. Frames wrap the copy-on-write mapping of the file
+// instead of copying it, so a replayed frame costs about as much as building its Mat headers.
+struct FeatureCacheReader : FrameSource
+{
+	MappedInputFile mapping;
+	vector<int64_t> chunkOffsets;
+	vector<int64_t> chunkPts;
+	int nextChunk;
+
+	FeatureCacheReader(string path) : nextChunk(0)
+	{
+		mapping.Open(path, true);
+
+		FeatureCacheHeader header;
+		if(mapping.size < (int64_t)sizeof(header))
+			throw std::runtime_error("Truncated feature cache: " + path);
+		memcpy(&header, mapping.data, sizeof(header));
+		if(memcmp(header.magic, featureCacheMagic, sizeof(header.magic)) != 0 || header.version != featureCacheVersion)
+			throw std::runtime_error("Not a feature cache (or of another version): " + path);
+
+		FrameCount = header.frameCount;
+		OriginalFrameSize = Size(header.originalWidth, header.originalHeight);
+		DownsampledFrameSize = Size(header.downsampledWidth, header.downsampledHeight);
+		FlowGridSize = Size(header.flowWidth, header.flowHeight);
+		flowGridStep = OriginalFrameSize.width / FlowGridSize.width;
+		Roi = Rect(0, 0, OriginalFrameSize.width, OriginalFrameSize.height);
+		ptsPerFrame = header.ptsPerFrame;
+
+		// chunk index, only the chunk headers are touched
+		for(int64_t offset = sizeof(header); offset + (int64_t)sizeof(CachedFrameHeader) <= mapping.size; )
+		{
+			const CachedFrameHeader* chunk = (const CachedFrameHeader*)(mapping.data + offset);
+			if(chunk->chunkSize <= 0 || offset + chunk->chunkSize > mapping.size)
+				break;
+			chunkOffsets.push_back(offset);
+			chunkPts.push_back(chunk->pts);
+			offset += chunk->chunkSize;
+		}
+	}
+
+	Frame Read()
+	{
+		if(nextChunk >= chunkOffsets.size())
+			return Frame::Null(-1);
+
+		TIMERS.ReadingAndDecoding.Start();
+		uint8_t* chunk = mapping.data + chunkOffsets[nextChunk++];
+		const CachedFrameHeader& header = *(const CachedFrameHeader*)chunk;
+		float* data = (float*)(chunk + sizeof(CachedFrameHeader));
+
+		Size flowSize(header.flowCols, header.flowRows);
+		int flowArea = flowSize.area();
+		Frame res(header.frameIndex, Mat_<float>(flowSize, data), Mat_<float>(flowSize, data + flowArea),
+			Mat_<bool>(flowSize, (bool*)(data + 3*flowArea + cachedRbhMaps*header.mapRows*header.mapCols)));
+		res.motionTextureMap = Mat(flowSize, CV_32FC1, data + 2*flowArea);
+		res.PTS = header.pts;
+		res.Span = header.span;
+		res.PictType = header.pictType;
+		res.NoMotionVectors = header.noMotionVectors != 0;
+		res.DctOfPicture = header.dctOfPicture != 0;
+
+		if(header.mapRows > 0)
+		{
+			Size mapSize(header.mapCols, header.mapRows);
+			float* maps = data + 3*flowArea;
+			res.spatialVarianceMap = Mat(mapSize, CV_32FC1, maps);
+			res.dcMap = Mat(mapSize, CV_32FC1, maps + mapSize.area());
+			res.verticalVarianceMap = Mat(mapSize, CV_32FC1, maps + 2*mapSize.area());
+			res.horizontalVarianceMap = Mat(mapSize, CV_32FC1, maps + 3*mapSize.area());
+		}
+		TIMERS.ReadingAndDecoding.Stop();
+		return res;
+	}
+
+	// cached frames are all independent, so this goes straight to the first frame at or after pts
+	bool SeekToPts(int64_t pts)
+	{
+		nextChunk = 0;
+		while(nextChunk < chunkPts.size() && chunkPts[nextChunk] < pts)
+			nextChunk++;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include "log.h"
+#include "options.h"
+#include "desc_info.h"
+
+#ifndef __FEATURE_GRAPH_H__
+#define __FEATURE_GRAPH_H__
+
+// which intermediates the enabled channels consume, worked out once from the options. everything upstream of a
+// channel is computed at most once per frame, and not at all when no enabled channel needs it:
+//
+//   motion vectors -> flow (summed once, shared by HOF and MBH)    -> HOF, MBH
+//                  -> Missing                                     -> DC thumbnail
+//   DCT coefficients -> Rbh maps                                  -> spatial, dc, vertical, horizontal
+//                             -> DC thumbnail                     -> HOG (-hogsource dc)
+//   pixels                                                        -> HOG (-hogsource bgr/luma)
+//
+// a feature cache being written consumes motion vectors and Rbh maps, so that it can serve any channel later. saliency
+// pruning (-saliency, -topk) consumes the motion vectors and their partition texture
+struct FeatureGraph
+{
+	bool Flow;
+	bool MotionVectors;
+	bool DcImage;
+	bool RbhMaps;
+	bool DctCoefficients;
+	bool Pixels;
+
+	FeatureGraph(Options& opts, DescInfo& hogInfo, DescInfo& hofInfo, DescInfo& mbhInfo, DescInfo& spatialVarianceInfo,
+		DescInfo& dcInfo, DescInfo& verticalVarianceInfo, DescInfo& horizontalVarianceInfo)
+	{
+		bool caching = opts.CachePath != "";
+
+		Flow = hofInfo.enabled || mbhInfo.enabled || caching;
+		DcImage = hogInfo.enabled && opts.HogInput == HogFromDc;
+		Pixels = hogInfo.enabled && !DcImage;
+		MotionVectors = Flow || DcImage || opts.PruningEnabled();
+		RbhMaps = spatialVarianceInfo.enabled || dcInfo.enabled || verticalVarianceInfo.enabled
+			|| horizontalVarianceInfo.enabled || DcImage || caching;
+		DctCoefficients = RbhMaps;
+	}
+
+	void Explain()
+	{
+		log("Computed: motion vectors %s, flow %s, DCT %s, Rbh maps %s, DC thumbnail %s, pixels %s",
+			yesno(MotionVectors), yesno(Flow), yesno(DctCoefficients), yesno(RbhMaps), yesno(DcImage), yesno(Pixels));
+	}
+};
+
+#endif
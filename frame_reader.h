@@ -13,6 +13,11 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
@@ -45,32 +50,129 @@ using namespace cv;
 #ifndef __FRAME_READER_H__
 #define __FRAME_READER_H__
 
-struct FrameReader
+struct FrameReaderSettings
+{
+	bool ReadRawImages;
+	bool MemoryMappedInput; // feed libavformat from an mmap of the input instead of its own file IO
+	bool FastDecode; // skip the IDCT and deblocking, only bitstream-level data (motion vectors, mb types, DCT) is valid
+	bool DropNonReferenceFrames; // don't decode B-frames nobody predicts from; the kept frames report the gap in Frame::Span
+	bool ReadMotionVectors;
+	bool ReadDctCoefficients; // without them the decoder isn't asked to keep dct_coeff
+	bool PictureDctCoefficients; // for codecs without dct_coeff (H.264), a DCT of the decoded luma instead of nothing
+	bool NativeFlowGrid; // flow on the 8x8 block grid with every partition's vector, instead of one per macroblock
+	double FlowScale; // applied to the motion vectors while they are written into the flow grid
+	Rect Roi; // pixels to read motion vectors, coefficients and raw images from, empty for the whole frame
+
+	FrameReaderSettings(bool readRawImages = true)
+		: ReadRawImages(readRawImages), MemoryMappedInput(false), FastDecode(false), DropNonReferenceFrames(false),
+		ReadMotionVectors(true), ReadDctCoefficients(true), PictureDctCoefficients(false), NativeFlowGrid(false), FlowScale(1)
+	{
+	}
+};
+
+// private mapping of the whole input file, read by libavformat through custom IO callbacks. a writable mapping is
+// copy-on-write, the file itself is never modified
+struct MappedInputFile
+{
+	uint8_t* data;
+	int64_t size;
+	int64_t pos;
+	int fd;
+
+	MappedInputFile() : data(NULL), size(0), pos(0), fd(-1)
+	{
+	}
+
+	void Open(string path, bool writable = false)
+	{
+		struct stat st;
+		fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0 || fstat(fd, &st) != 0)
+			throw std::runtime_error("Couldn't open file: " + path);
+
+		size = st.st_size;
+		void* mapped = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapped == MAP_FAILED)
+			throw std::runtime_error("Couldn't mmap file: " + path);
+		data = (uint8_t*)mapped;
+		madvise(data, size, MADV_SEQUENTIAL);
+	}
+
+	~MappedInputFile()
+	{
+		if(data)
+			munmap(data, size);
+		if(fd >= 0)
+			close(fd);
+	}
+};
+
+struct FrameReader : FrameSource
 {
 	static const int gridStep = 16;
-	Size DownsampledFrameSize;
-	Size OriginalFrameSize;
-	int FrameCount;
+	float flowScale;
 	int frameIndex;
 	int64_t prev_pts;
+	bool DropNonReferenceFrames;
 	bool ReadRawImages;
+	bool readMotionVectors;
+	bool readDctCoefficients;
+	bool NoCodecDctCoefficients; // the decoder never saves dct_coeff (H.264)
+	bool pictureDctCoefficients; // the codec doesn't export coefficients, they're computed from the decoded luma instead
+	bool FastDecoding;
+	bool LumaRawImages; // single-channel raw images, scaled by the reader straight to RawImageSize
+	bool lumaFromPlane; // the luma plane of planar yuv is scaled directly, ROI only
+	Size RawImageSize;
 
 	AVFrame         *pFrame;
 	AVFormatContext *pFormatCtx;
 	SwsContext		*img_convert_ctx;
+	SwsContext		*luma_convert_ctx;
 	AVStream		*video_st;
 	AVIOContext		*pAvioContext;
-	uint8_t			*pAvio_buffer;
-	FILE* in;
+	MappedInputFile mappedInput;
 	AVFrame rgb_picture;
 	int videoStream;
+	AVPacket pkt, pktCopy; // packet being decoded and the cursor into it
+	bool packetPending;
 
 	static int avio_readPacket(void* opaque, uint8_t* buf, int buf_size)
 	{
+		MappedInputFile* file = (MappedInputFile*)opaque;
 		TIMERS.Reading.Start();
-		int res = fread(buf, 1, buf_size, (FILE*)opaque);
+		int res = (int)min<int64_t>(buf_size, file->size - file->pos);
+		memcpy(buf, file->data + file->pos, res);
+		file->pos += res;
 		TIMERS.Reading.Stop();
-		return res;
+		return res > 0 ? res : AVERROR_EOF;
+	}
+
+	static int64_t avio_seek(void* opaque, int64_t offset, int whence)
+	{
+		MappedInputFile* file = (MappedInputFile*)opaque;
+		if(whence & AVSEEK_SIZE)
+			return file->size;
+
+		int64_t pos;
+		switch(whence & ~AVSEEK_FORCE)
+		{
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = file->pos + offset;
+			break;
+		case SEEK_END:
+			pos = file->size + offset;
+			break;
+		default:
+			return AVERROR(EINVAL);
+		}
+
+		if(pos < 0 || pos > file->size)
+			return AVERROR(EINVAL);
+		file->pos = pos;
+		return pos;
 	}
 
 	static void av_null_log_callback(void*, int, const char*, va_list)
@@ -87,35 +189,43 @@ struct FrameReader
 		av_log(NULL, AV_LOG_ERROR, "print_ffmpeg_error: %s\n", errbuf_ptr);
 	}
 	
-	FrameReader(string videoPath, bool readRawImages)
+	FrameReader(string videoPath, FrameReaderSettings settings)
 	{
-		ReadRawImages = readRawImages;
+		ReadRawImages = settings.ReadRawImages;
+		readMotionVectors = settings.ReadMotionVectors;
+		readDctCoefficients = settings.ReadDctCoefficients;
+		DropNonReferenceFrames = settings.DropNonReferenceFrames;
+		prev_pts = -1;
+		packetPending = false;
+		LumaRawImages = false;
+		lumaFromPlane = false;
+		NoCodecDctCoefficients = false;
+		pictureDctCoefficients = false;
+		FastDecoding = false;
+		luma_convert_ctx = NULL;
 		pAvioContext = NULL;
-		pAvio_buffer = NULL;
-		in = NULL;
 		frameIndex = 1;
 		videoStream = -1;
 		pFormatCtx = avformat_alloc_context();
 
 		av_register_all();
 
-		bool readWholeFileInMemory = false; // disabling for now. possibly manual probing is needed when using custom IO: http://cdry.wordpress.com/2009/09/09/using-custom-io-callbacks-with-ffmpeg/
-		if(readWholeFileInMemory)
+		if(settings.MemoryMappedInput)
 		{
-			const int bufSize = 20* (1 << 20);
-			pAvio_buffer = (uint8_t*)av_malloc(bufSize);
-			FILE* in = fopen(videoPath.c_str(), "rb");
+			// libavformat probes the custom context itself (with the file name as a hint), which needs working seeks
+			const int bufSize = 1 << 18;
+			mappedInput.Open(videoPath);
 			pAvioContext = avio_alloc_context(
-				pAvio_buffer,
+				(uint8_t*)av_malloc(bufSize),
 				bufSize,
 				false,
-				in,
+				&mappedInput,
 				avio_readPacket,
 				NULL,
-				NULL);
+				avio_seek);
 
-			videoPath = "dummyFileName";
 			pFormatCtx->pb = pAvioContext;
+			pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
 		}
 		int err = 0;
 
@@ -138,7 +248,28 @@ struct FrameReader
 			{
 				// don't care FF_DEBUG_VIS_MV_B_BACK
 				//enc->debug_mv = FF_DEBUG_VIS_MV_P_FOR | FF_DEBUG_VIS_MV_B_FOR;
-				enc->debug |= FF_DEBUG_DCT_COEFF;
+				// only the MPEG-style block decoding (MPEG-1/2/4, H.263 and relatives) saves dct_coeff. H.264's 4x4 and 8x8
+				// integer transform coefficients are never exported. the DCT of the picture can stand in for them, but only
+				// on request: in P/B-frames it describes texture, not the prediction residual MPEG-4 coefficients transform
+				NoCodecDctCoefficients = enc->codec_id == CODEC_ID_H264;
+				pictureDctCoefficients = settings.ReadDctCoefficients && settings.PictureDctCoefficients && NoCodecDctCoefficients;
+				FastDecoding = settings.FastDecode && !settings.ReadRawImages && !pictureDctCoefficients;
+
+				if(settings.ReadDctCoefficients && !pictureDctCoefficients)
+					enc->debug |= FF_DEBUG_DCT_COEFF;
+
+				if(FastDecoding)
+				{
+					// motion vectors, macroblock types and coefficients are parsed before these stages. in
+					// MPV_decode_mb_internal motion compensation still runs, skip_idct only returns before the
+					// IDCT/add (after dct_coeff has been saved), and skip_loop_filter drops the deblocking
+					enc->skip_idct = AVDISCARD_ALL;
+					enc->skip_loop_filter = AVDISCARD_ALL;
+					enc->flags2 |= CODEC_FLAG2_FAST;
+				}
+
+				if(settings.DropNonReferenceFrames)
+					enc->skip_frame = AVDISCARD_NONREF;
 
 				AVCodec *pCodec = avcodec_find_decoder(enc->codec_id);
 
@@ -155,15 +286,19 @@ struct FrameReader
 				int cols = enc->width;
 				int rows = enc->height;
 
+				double frameScale = av_q2d (video_st->time_base) * av_q2d (video_st->r_frame_rate);
+				ptsPerFrame = frameScale > 0 ? 1 / frameScale : 1;
+
 				FrameCount = video_st->nb_frames;
 				if(FrameCount == 0)
-				{
-					double frameScale = av_q2d (video_st->time_base) * av_q2d (video_st->r_frame_rate);
 					FrameCount = (double)video_st->duration * frameScale;
-				}
 
 				DownsampledFrameSize = Size(cols / gridStep, rows / gridStep);
+				flowGridStep = settings.NativeFlowGrid ? gridStep / 2 : gridStep;
+				flowScale = settings.FlowScale;
 				OriginalFrameSize = Size(cols, rows);
+				Roi = AlignRoi(settings.Roi);
+				FlowGridSize = Size(Roi.width / flowGridStep, Roi.height / flowGridStep);
 
 				PixelFormat target = PIX_FMT_BGR24;
 				img_convert_ctx = sws_getContext(video_st->codec->width,
@@ -187,21 +322,34 @@ struct FrameReader
 			throw std::runtime_error("Video stream not found");
 	}
 
-	bool GetNextFrame()
+	// grows the ROI to whole macroblocks and clips it to the frame, so that every flow cell and DCT block of a frame
+	// comes from macroblocks inside it. an empty ROI is the whole frame
+	Rect AlignRoi(Rect roi)
 	{
-		static bool initialized = false;
-		static AVPacket pkt, pktCopy;
+		if(roi.area() == 0)
+			return Rect(0, 0, OriginalFrameSize.width, OriginalFrameSize.height);
+
+		int x0 = max(0, roi.x / gridStep) * gridStep;
+		int y0 = max(0, roi.y / gridStep) * gridStep;
+		int x1 = min(OriginalFrameSize.width, (roi.x + roi.width + gridStep - 1) / gridStep * gridStep);
+		int y1 = min(OriginalFrameSize.height, (roi.y + roi.height + gridStep - 1) / gridStep * gridStep);
+		if(x1 - x0 < gridStep || y1 - y0 < gridStep)
+			throw std::runtime_error("ROI doesn't cover a whole macroblock of the frame");
+		return Rect(x0, y0, x1 - x0, y1 - y0);
+	}
 
+	bool GetNextFrame()
+	{
 		while(true)
 		{
-			if(initialized)
+			if(packetPending)
 			{
 				if(process_frame(&pktCopy) > 0)
 					return true;
 				else
 				{
 					av_free_packet(&pkt);
-					initialized = false;
+					packetPending = false;
 				}
 			}
 
@@ -209,19 +357,65 @@ struct FrameReader
 			if(ret != 0)
 				break;
 
-			initialized = true;
+			packetPending = true;
 			pktCopy = pkt;
 			if(pkt.stream_index != videoStream )
 			{
 				av_free_packet(&pkt);
-				initialized = false;
+				packetPending = false;
 				continue;
 			}
 		}
 
-		return process_frame(&pkt);
+		// end of stream, drain the frames the decoder still holds back
+		AVPacket flushPkt;
+		av_init_packet(&flushPkt);
+		flushPkt.data = NULL;
+		flushPkt.size = 0;
+		return process_frame(&flushPkt);
+	}
+
+	// positions the demuxer on the keyframe at or before pts (in stream time base, like Frame::PTS)
+	bool SeekToPts(int64_t pts)
+	{
+		if(packetPending)
+		{
+			av_free_packet(&pkt);
+			packetPending = false;
+		}
+
+		if(av_seek_frame(pFormatCtx, videoStream, pts, AVSEEK_FLAG_BACKWARD) < 0)
+			return false;
+		avcodec_flush_buffers(video_st->codec);
+		return true;
+	}
+
+	// pts of all keyframes of the video stream, taken from the container index when there is one and otherwise from
+	// a scan over the packets (nothing is decoded). the demuxer is rewound to the start afterwards
+	vector<int64_t> ScanKeyframePts()
+	{
+		vector<int64_t> res;
+		for(int i = 0; i < video_st->nb_index_entries; i++)
+			if(video_st->index_entries[i].flags & AVINDEX_KEYFRAME)
+				res.push_back(video_st->index_entries[i].timestamp);
+		if(!res.empty())
+			return res;
+
+		AVPacket scanPkt;
+		while(av_read_frame(pFormatCtx, &scanPkt) == 0)
+		{
+			if(scanPkt.stream_index == videoStream && (scanPkt.flags & AV_PKT_FLAG_KEY))
+				res.push_back(scanPkt.pts != AV_NOPTS_VALUE ? scanPkt.pts : scanPkt.dts);
+			av_free_packet(&scanPkt);
+		}
+		SeekToPts(StartPts());
+		return res;
 	}
 
+	int64_t StartPts()
+	{
+		return video_st->start_time != AV_NOPTS_VALUE ? video_st->start_time : 0;
+	}
 
 	bool process_frame(AVPacket *pkt)
 	{
@@ -240,11 +434,14 @@ struct FrameReader
 
 	void PutMotionVectorInMatrix(MotionVector& mv, Frame& f)
 	{
-		int i_16 = mv.Y / gridStep;
-		int j_16 = mv.X / gridStep;
+		if(!Roi.contains(Point(mv.X, mv.Y)))
+			return;
+
+		int i_16 = (mv.Y - Roi.y) / flowGridStep;
+		int j_16 = (mv.X - Roi.x) / flowGridStep;
 
-		i_16 = max(0, min(i_16, DownsampledFrameSize.height-1)); 
-		j_16 = max(0, min(j_16, DownsampledFrameSize.width-1));
+		i_16 = max(0, min(i_16, FlowGridSize.height-1)); 
+		j_16 = max(0, min(j_16, FlowGridSize.width-1));
 
 		if(mv.NoMotionVector())
 		{
@@ -252,11 +449,14 @@ struct FrameReader
 		}
 		else
 		{
-			f.Dx(i_16, j_16) = mv.Dx;
-			f.Dy(i_16, j_16) = mv.Dy;
+			f.Dx(i_16, j_16) = mv.Dx * flowScale;
+			f.Dy(i_16, j_16) = mv.Dy * flowScale;
 		}
     }
 
+#ifdef DEBUG_MOTION_VECTORS
+	// reference implementation, builds a full MotionVector (with type and segmentation codes) for every partition.
+	// it only writes the cell under each partition's center, which on the native 8x8 grid leaves holes
 	void InitMotionVector(MotionVector& mv, int sx, int sy, int mx, int my, int dx, int dy, int mb_type)
 	{
 		char typeCode = '_';
@@ -314,9 +514,19 @@ struct FrameReader
 		mv.SegmCode = segmCode;
 	}
 
+	// every flow cell of the macroblock, on either grid and relative to the ROI, with partial last rows and columns
+	// clamped into the grid like in PutMotionVectorInMatrix
 	void PutMotionTextureInMatrix(float val, int mb_x, int mb_y, Frame& f)
 	{
-		f.motionTextureMap.at<float>(mb_y, mb_x) = val;
+		int x = mb_x*gridStep - Roi.x, y = mb_y*gridStep - Roi.y;
+		if(x < 0 || y < 0 || x >= Roi.width || y >= Roi.height)
+			return;
+
+		int i1 = min((y + gridStep - 1) / flowGridStep, FlowGridSize.height-1);
+		int j1 = min((x + gridStep - 1) / flowGridStep, FlowGridSize.width-1);
+		for(int i = min(y / flowGridStep, FlowGridSize.height-1); i <= i1; i++)
+			for(int j = min(x / flowGridStep, FlowGridSize.width-1); j <= j1; j++)
+				f.motionTextureMap.at<float>(i, j) = val;
 	}
 
 	void ReadMotionVectors(Frame& f)
@@ -328,7 +538,8 @@ struct FrameReader
 		const int mb_stride = mb_width + 1;
 		const int mv_sample_log2 = 4 - pFrame->motion_subsample_log2;
 		const int mv_stride = (mb_width << mv_sample_log2) + (pCodecCtx->codec_id == CODEC_ID_H264 ? 0 : 1);
-		const int quarter_sample = (pCodecCtx->flags & CODEC_FLAG_QPEL) != 0;
+		// H.264 vectors are always in quarter pels, CODEC_FLAG_QPEL is only about MPEG-4
+		const int quarter_sample = (pCodecCtx->flags & CODEC_FLAG_QPEL) != 0 || pCodecCtx->codec_id == CODEC_ID_H264;
 		const int shift = 1 + quarter_sample;
 
 		//typedef short DCTELEM;
@@ -448,65 +659,245 @@ struct FrameReader
 			}
 		}
 	}
-
-	void ReadRawImage(Frame& res)
+#else
+	// partitions of a macroblock in 8x8 units of the motion_val grid
+	struct MbPartitions
 	{
-		rgb_picture.data[0] = res.RawImage.ptr();
-		sws_scale(img_convert_ctx, pFrame->data,
-			pFrame->linesize, 0,
-			video_st->codec->height,
-			rgb_picture.data, rgb_picture.linesize);
+		int count;
+		int ox[4], oy[4];
+		int w, h;
+		float texture;
+		int interlacedDyScale; // 16x8 and 8x16 field vectors count field lines
+	};
+
+	static const MbPartitions& PartitionsOf(int mb_type)
+	{
+		// (mb_type >> 3) & 0xF holds the 16x16, 16x8, 8x16 and 8x8 bits, 8x8 taking precedence over 16x8 over 8x16.
+		// everything else, intra included, is read as 16x16
+		static const unsigned char classOf[16] = {0, 0, 1, 1, 2, 2, 1, 1, 3, 3, 3, 3, 3, 3, 3, 3};
+		static const MbPartitions partitions[4] =
+		{
+			{1, {0}, {0}, 2, 2, 4.0f, 1},                     // 16x16
+			{2, {0, 0}, {0, 1}, 2, 1, 8.0f, 2},               // 16x8
+			{2, {0, 1}, {0, 0}, 1, 2, 8.0f, 2},               // 8x16
+			{4, {0, 1, 0, 1}, {0, 0, 1, 1}, 1, 1, 16.0f, 1}   // 8x8
+		};
+		return partitions[classOf[(mb_type >> 3) & 0xF]];
 	}
 
-	void ReadDctCoefficients(Frame& f)
+	void ReadMotionVectors(Frame& f)
 	{
 		AVCodecContext* pCodecCtx = video_st->codec;
+		if(!pFrame->motion_val)
+			return;
+
+		// P-frames predict from list 0, B-frames from both; a later direction overwrites the earlier one
+		const int directions = pFrame->pict_type == AV_PICTURE_TYPE_P ? 1 : pFrame->pict_type == AV_PICTURE_TYPE_B ? 2 : 0;
+		if(directions == 0)
+			return;
 
 		const int mb_width  = (pCodecCtx->width + 15) / 16;
 		const int mb_height = (pCodecCtx->height + 15) / 16;
-
-		Mat_<short> dct(mb_height*mb_width, 64*6);
-		memcpy(dct.ptr(), pFrame->dct_coeff, sizeof(short)*dct.rows*dct.cols);
-
-		Mat dctMap(pCodecCtx->height, pCodecCtx->width, CV_32FC1);
-
-		for (int mb_y = 0; mb_y < mb_height; mb_y++)
+		const int mb_stride = mb_width + 1;
+		const int mv_sample_log2 = 4 - pFrame->motion_subsample_log2;
+		const int mv_stride = (mb_width << mv_sample_log2) + (pCodecCtx->codec_id == CODEC_ID_H264 ? 0 : 1);
+		// H.264 vectors are always in quarter pels, CODEC_FLAG_QPEL is only about MPEG-4
+		const int quarter_sample = (pCodecCtx->flags & CODEC_FLAG_QPEL) != 0 || pCodecCtx->codec_id == CODEC_ID_H264;
+		const int shift = 1 + quarter_sample;
+		const int rows = FlowGridSize.height;
+		const int cols = FlowGridSize.width;
+		// motion_val is kept in 8x8 units. on the 16x16 grid all partitions of a macroblock fall into its cell, where
+		// only the last one would stay, so only that one is read
+		const int cellShift = flowGridStep == gridStep ? 1 : 0;
+		// only the macroblocks of the ROI are visited, the grid starts at its top left one
+		const int mb_x0 = Roi.x / gridStep, mb_x1 = min(mb_width, (Roi.x + Roi.width + gridStep - 1) / gridStep);
+		const int mb_y0 = Roi.y / gridStep, mb_y1 = min(mb_height, (Roi.y + Roi.height + gridStep - 1) / gridStep);
+
+		for(int mb_y = mb_y0; mb_y < mb_y1; mb_y++)
 		{
-			for (int mb_x = 0; mb_x < mb_width; mb_x++)
+			const uint32_t* mbTypes = pFrame->mb_type + mb_y * mb_stride;
+			for(int mb_x = mb_x0; mb_x < mb_x1; mb_x++)
 			{
-				short *macroblock_dct = (short*)malloc(sizeof(short)*64*4);
-				memcpy(macroblock_dct, dct.ptr(mb_y*mb_width+mb_x), sizeof(short)*64*4);
-				short *block_dct = (short*)malloc(sizeof(short)*64);
-				for(int j = 0; j < 2; ++j)
+				const int mb_type = mbTypes[mb_x];
+				const MbPartitions& parts = PartitionsOf(mb_type);
+				const int dyScale = IS_INTERLACED(mb_type) ? parts.interlacedDyScale : 1;
+
+				for(int p = cellShift ? parts.count - 1 : 0; p < parts.count; p++)
 				{
-					for(int i = 0; i < 2; ++i)
+					const int bx = mb_x*2 + parts.ox[p];
+					const int by = mb_y*2 + parts.oy[p];
+					const int xy = (bx + by*mv_stride) << (mv_sample_log2-1);
+
+					// partitions of partial last rows and columns are clamped into the grid, like in PutMotionVectorInMatrix
+					const int gx = bx - mb_x0*2, gy = by - mb_y0*2;
+					const int i0 = min(gy >> cellShift, rows - 1), i1 = min((gy + parts.h - 1) >> cellShift, rows - 1);
+					const int j0 = min(gx >> cellShift, cols - 1), j1 = min((gx + parts.w - 1) >> cellShift, cols - 1);
+
+					for(int direction = 0; direction < directions; direction++)
 					{
-						memcpy(block_dct, macroblock_dct+(j*2+i)*64, sizeof(short)*64);
-						Mat_<short> block(8, 8);
-						memcpy(block.ptr(), block_dct, sizeof(short)*64);
-						for(int n = 0; n < 8; ++n)
+						const bool uses = USES_LIST(mb_type, direction);
+						//inverting vectors to match optical flow directions
+						const float dx = uses ? -(pFrame->motion_val[direction][xy][0] >> shift) * flowScale : 0;
+						const float dy = uses ? -(pFrame->motion_val[direction][xy][1] >> shift) * dyScale * flowScale : 0;
+						for(int i = i0; i <= i1; i++)
 						{
-							for(int m = 0; m < 8; ++m)
+							float* dxRow = f.Dx[i];
+							float* dyRow = f.Dy[i];
+							bool* missingRow = f.Missing[i];
+							for(int j = j0; j <= j1; j++)
 							{
-								dctMap.at<float>(mb_y*16+j*8+n, mb_x*16+i*8+m) = float(block(n, m));
+								if(uses)
+								{
+									dxRow[j] = dx;
+									dyRow[j] = dy;
+								}
+								else
+									missingRow[j] = true;
 							}
 						}
 					}
+
+					for(int i = i0; i <= i1; i++)
+						for(int j = j0; j <= j1; j++)
+							f.motionTextureMap.at<float>(i, j) = parts.texture;
 				}
-				free(block_dct);
-				free(macroblock_dct);
 			}
 		}
+	}
+#endif
+
+	static bool IsPlanarYuv8(PixelFormat fmt)
+	{
+		return fmt == PIX_FMT_YUV420P || fmt == PIX_FMT_YUVJ420P
+			|| fmt == PIX_FMT_YUV422P || fmt == PIX_FMT_YUVJ422P
+			|| fmt == PIX_FMT_YUV444P || fmt == PIX_FMT_YUVJ444P
+			|| fmt == PIX_FMT_YUV440P || fmt == PIX_FMT_YUV411P || fmt == PIX_FMT_YUV410P;
+	}
+
+	// switches raw images to a gray image of the given size, produced by a single downscaling pass over the luma plane
+	// (over the ROI of it for planar yuv)
+	void ReadLumaImagesAt(Size targetSize)
+	{
+		AVCodecContext* pCodecCtx = video_st->codec;
+
+		// for planar yuv the first plane already is a gray image, so chroma is never touched
+		lumaFromPlane = IsPlanarYuv8(pCodecCtx->pix_fmt);
+		PixelFormat source = lumaFromPlane ? PIX_FMT_GRAY8 : pCodecCtx->pix_fmt;
+		Size sourceSize = lumaFromPlane ? Roi.size() : OriginalFrameSize;
+		luma_convert_ctx = sws_getContext(sourceSize.width,
+			sourceSize.height,
+			source,
+			targetSize.width,
+			targetSize.height,
+			PIX_FMT_GRAY8,
+			SWS_AREA,
+			NULL, NULL, NULL);
+		if(luma_convert_ctx == NULL)
+			throw std::runtime_error("Couldn't create luma scaling context");
+
+		LumaRawImages = true;
+		RawImageSize = targetSize;
+	}
+
+	// other pixel formats are scaled whole into a frame-sized gray image, of which the ROI is kept
+	Size LumaImageSize()
+	{
+		if(lumaFromPlane)
+			return RawImageSize;
+		return Size(RawImageSize.width * OriginalFrameSize.width / Roi.width, RawImageSize.height * OriginalFrameSize.height / Roi.height);
+	}
+
+	void ReadRawImage(Frame& res)
+	{
+		if(LumaRawImages)
+		{
+			uint8_t* src[4] = {pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->data[3]};
+			int srcHeight = video_st->codec->height;
+			if(lumaFromPlane)
+			{
+				src[0] += Roi.y * pFrame->linesize[0] + Roi.x;
+				srcHeight = Roi.height;
+			}
+			uint8_t* dst[4] = {res.RawImage.ptr(), NULL, NULL, NULL};
+			int dstStride[4] = {(int)res.RawImage.step, 0, 0, 0};
+			sws_scale(luma_convert_ctx, src,
+				pFrame->linesize, 0,
+				srcHeight,
+				dst, dstStride);
+			if(!lumaFromPlane)
+			{
+				int x = min(Roi.x * res.RawImage.cols / OriginalFrameSize.width, res.RawImage.cols - RawImageSize.width);
+				int y = min(Roi.y * res.RawImage.rows / OriginalFrameSize.height, res.RawImage.rows - RawImageSize.height);
+				res.RawImage = res.RawImage(Rect(x, y, RawImageSize.width, RawImageSize.height));
+			}
+			return;
+		}
+
+		rgb_picture.data[0] = res.RawImage.ptr();
+		sws_scale(img_convert_ctx, pFrame->data,
+			pFrame->linesize, 0,
+			video_st->codec->height,
+			rgb_picture.data, rgb_picture.linesize);
+		if(Roi.size() != OriginalFrameSize)
+			res.RawImage = res.RawImage(Roi);
+	}
+
+	// 8x8 DCT of the decoded luma, in the layout of the decoder's dct_coeff (raster order, chroma blocks left empty) and
+	// at its scale (orthonormal, DC = 8 * block mean). unlike decoder coefficients these transform the picture and not
+	// a prediction residual, which the frame records in DctOfPicture
+	void ComputePictureDctCoefficients(Frame& f)
+	{
+		const int blockSize = DctCoefficientView::blockSize;
+
+		// computed for the ROI only, so the view starts at its first block
+		DctCoefficientView& view = f.dctCoefficients;
+		view.BlockGridSize = Size(Roi.width / blockSize, Roi.height / blockSize);
+		view.mbWidth = (view.BlockGridSize.width + 1) / 2;
+		view.coeffs = Mat_<short>::zeros(view.mbWidth*((view.BlockGridSize.height + 1) / 2),
+			DctCoefficientView::blockArea*DctCoefficientView::blocksPerMacroblock);
+
+		Mat luma(Roi.height, Roi.width, CV_8UC1, pFrame->data[0] + Roi.y*pFrame->linesize[0] + Roi.x, pFrame->linesize[0]);
+		Mat_<float> pixels(blockSize, blockSize), coeffs(blockSize, blockSize);
+		for(int blk_j = 0; blk_j < view.BlockGridSize.height; blk_j++)
+		{
+			for(int blk_i = 0; blk_i < view.BlockGridSize.width; blk_i++)
+			{
+				luma(Rect(blk_i*blockSize, blk_j*blockSize, blockSize, blockSize)).convertTo(pixels, CV_32F);
+				dct(pixels, coeffs);
+				short* block = (short*)view.Block(blk_j, blk_i);
+				for(int k = 0; k < DctCoefficientView::blockArea; k++)
+					block[k] = saturate_cast<short>(coeffs(k / blockSize, k % blockSize));
+			}
+		}
+		f.DctOfPicture = true;
+	}
+
+	void ReadDctCoefficients(Frame& f)
+	{
+		AVCodecContext* pCodecCtx = video_st->codec;
+		if(pFrame->dct_coeff == NULL)
+			return;
+
+		const int mb_width  = (pCodecCtx->width + 15) / 16;
+		const int mb_height = (pCodecCtx->height + 15) / 16;
 
-		f.dctMap = dctMap.clone();
+		DctCoefficientView& view = f.dctCoefficients;
+		view.coeffs = Mat_<short>(mb_height*mb_width, DctCoefficientView::blockArea*DctCoefficientView::blocksPerMacroblock, (short*)pFrame->dct_coeff);
+		view.mbWidth = mb_width;
+		view.blockOrigin = Point(Roi.x / DctCoefficientView::blockSize, Roi.y / DctCoefficientView::blockSize);
+		view.BlockGridSize = Size(Roi.width / DctCoefficientView::blockSize, Roi.height / DctCoefficientView::blockSize);
+		// the decoder's coefficient buffer is reused by the next decode call
+		if(DetachDctCoefficients)
+			view.Detach();
 	}
 
 	Frame Read()
 	{
 		TIMERS.ReadingAndDecoding.Start();
-		Frame res(frameIndex, Mat_<float>::zeros(DownsampledFrameSize), Mat_<float>::zeros(DownsampledFrameSize), Mat_<bool>::zeros(DownsampledFrameSize));
-		res.RawImage = Mat(OriginalFrameSize, CV_8UC3);
-		res.motionTextureMap = Mat::zeros(DownsampledFrameSize, CV_32FC1);
+		Frame res(frameIndex, Mat_<float>::zeros(FlowGridSize), Mat_<float>::zeros(FlowGridSize), Mat_<bool>::zeros(FlowGridSize));
+		if(ReadRawImages)
+			res.RawImage = LumaRawImages ? Mat(LumaImageSize(), CV_8UC1) : Mat(OriginalFrameSize, CV_8UC3);
+		res.motionTextureMap = Mat::zeros(FlowGridSize, CV_32FC1);
 
 		bool read = GetNextFrame();
 		if(read)
@@ -514,15 +905,24 @@ struct FrameReader
 			AVPictureType tp = pFrame->pict_type;
 			char picType = tp == AV_PICTURE_TYPE_I ? 'I' : tp == AV_PICTURE_TYPE_B ? 'B' : tp == AV_PICTURE_TYPE_P ? 'P' : '?';
 
+			res.PictType = picType;
 			res.NoMotionVectors = picType == 'I';
 			//fragile, consult fresh f_select.c and ffprobe.c when updating ffmpeg
 			res.PTS = pFrame->pkt_pts != AV_NOPTS_VALUE ? pFrame->pkt_pts : (pFrame->pkt_dts != AV_NOPTS_VALUE ? pFrame->pkt_dts : prev_pts + 1);
+			if(DropNonReferenceFrames && frameIndex > 1)
+				res.Span = max(1, cvRound((res.PTS - prev_pts) / ptsPerFrame));
 			prev_pts = res.PTS;
-			if(!res.NoMotionVectors)
+			if(!res.NoMotionVectors && readMotionVectors)
+			{
 				ReadMotionVectors(res);
+				res.FlowQuantum = flowScale;
+			}
 			if(ReadRawImages)
 				ReadRawImage(res);
-			ReadDctCoefficients(res);
+			if(pictureDctCoefficients)
+				ComputePictureDctCoefficients(res);
+			else if(readDctCoefficients)
+				ReadDctCoefficients(res);
 		}
 		else
 		{
@@ -542,12 +942,12 @@ struct FrameReader
 		//sws_freeContext(img_convert_ctx);
 		/*avcodec_close(video_st->codec);
 		av_close_input_file(pFormatCtx);*/
-		/*if(pAvio_buffer)
-			av_free(pAvio_buffer);*/
-		/*if(pAvioContext)
-			av_free(pAvioContext);*/
-		if(in)
-			fclose(in);
+		// libavformat may have replaced the buffer we gave it, so free whatever the context holds now
+		if(pAvioContext)
+		{
+			av_free(pAvioContext->buffer);
+			av_free(pAvioContext);
+		}
 	}
 };
 
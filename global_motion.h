@@ -0,0 +1,135 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "common.h"
+#include "diag.h"
+#include <opencv/cv.h>
+
+using namespace std;
+using namespace cv;
+
+#ifndef __GLOBAL_MOTION_H__
+#define __GLOBAL_MOTION_H__
+
+// camera motion from the motion vector grid alone: an affine flow model
+//     dx = a0 + a1*x + a2*y,  dy = b0 + b1*x + b2*y    (x, y in flow grid cells)
+// fitted by iteratively reweighted least squares with Tukey's biweight, so that moving objects end up as outliers.
+// cells without a vector (Missing, i.e. intra blocks in P-frames) are left out. the compensated flow, i.e. the flow
+// minus the model, goes to Frame::WarpDx/WarpDy
+struct GlobalMotionEstimator
+{
+	static const int iterations = 5;
+	static const int minCells = 12; // below this the frame is left uncompensated
+	double a[3], b[3];
+
+	GlobalMotionEstimator()
+	{
+		a[0] = a[1] = a[2] = b[0] = b[1] = b[2] = 0;
+	}
+
+	// solves the 3x3 normal equations m * res = v by Cramer's rule
+	static bool Solve3(const double m[3][3], const double v[3], double res[3])
+	{
+		double det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+			- m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+			+ m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+		if(fabs(det) < 1e-9)
+			return false;
+
+		for(int k = 0; k < 3; k++)
+		{
+			double c[3][3];
+			for(int i = 0; i < 3; i++)
+				for(int j = 0; j < 3; j++)
+					c[i][j] = j == k ? v[i] : m[i][j];
+			res[k] = (c[0][0]*(c[1][1]*c[2][2] - c[1][2]*c[2][1])
+				- c[0][1]*(c[1][0]*c[2][2] - c[1][2]*c[2][0])
+				+ c[0][2]*(c[1][0]*c[2][1] - c[1][1]*c[2][0])) / det;
+		}
+		return true;
+	}
+
+	// weighted least squares fit over the given cells, false when the system is degenerate
+	bool Fit(const vector<Point>& cells, const vector<float>& weights, const Mat_<float>& dx, const Mat_<float>& dy)
+	{
+		double m[3][3] = {{0}}, vx[3] = {0}, vy[3] = {0};
+		for(int k = 0; k < cells.size(); k++)
+		{
+			double w = weights[k];
+			if(w == 0)
+				continue;
+			double basis[3] = {1, (double)cells[k].x, (double)cells[k].y};
+			for(int i = 0; i < 3; i++)
+			{
+				for(int j = 0; j < 3; j++)
+					m[i][j] += w * basis[i] * basis[j];
+				vx[i] += w * basis[i] * dx(cells[k]);
+				vy[i] += w * basis[i] * dy(cells[k]);
+			}
+		}
+		return Solve3(m, vx, a) && Solve3(m, vy, b);
+	}
+
+	double ResidualAt(Point p, const Mat_<float>& dx, const Mat_<float>& dy)
+	{
+		double rx = dx(p) - (a[0] + a[1]*p.x + a[2]*p.y);
+		double ry = dy(p) - (b[0] + b[1]*p.x + b[2]*p.y);
+		return sqrt(rx*rx + ry*ry);
+	}
+
+	// returns false (and leaves the frame alone) when there are too few vectors for a stable fit
+	bool Compensate(Frame& frame)
+	{
+		if(frame.NoMotionVectors || frame.Dx.empty())
+			return false;
+
+		TIMERS.GlobalMotionEstimation.Start();
+		vector<Point> cells;
+		for(int i = 0; i < frame.Dx.rows; i++)
+			for(int j = 0; j < frame.Dx.cols; j++)
+				if(!frame.Missing(i, j))
+					cells.push_back(Point(j, i));
+
+		bool fitted = cells.size() >= minCells;
+		vector<float> weights(cells.size(), 1.0f);
+		vector<float> residuals(cells.size());
+		for(int it = 0; fitted && it < iterations; it++)
+		{
+			fitted = Fit(cells, weights, frame.Dx, frame.Dy);
+			if(!fitted || it + 1 == iterations)
+				break;
+
+			// Tukey's biweight, with the scale taken from the median residual (1.4826 * MAD, c = 4.685)
+			for(int k = 0; k < cells.size(); k++)
+				residuals[k] = ResidualAt(cells[k], frame.Dx, frame.Dy);
+			vector<float> sorted(residuals);
+			nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+			double cutoff = 4.685 * max(1.4826 * sorted[sorted.size()/2], 1e-3);
+			for(int k = 0; k < cells.size(); k++)
+			{
+				double u = residuals[k] / cutoff;
+				weights[k] = u < 1 ? (1 - u*u)*(1 - u*u) : 0;
+			}
+		}
+
+		if(fitted)
+		{
+			frame.WarpDx.create(frame.Dx.size());
+			frame.WarpDy.create(frame.Dy.size());
+			for(int i = 0; i < frame.Dx.rows; i++)
+			{
+				for(int j = 0; j < frame.Dx.cols; j++)
+				{
+					bool missing = frame.Missing(i, j);
+					frame.WarpDx(i, j) = missing ? 0 : frame.Dx(i, j) - (a[0] + a[1]*j + a[2]*i);
+					frame.WarpDy(i, j) = missing ? 0 : frame.Dy(i, j) - (b[0] + b[1]*j + b[2]*i);
+				}
+			}
+		}
+		TIMERS.GlobalMotionEstimation.Stop();
+		return fitted;
+	}
+};
+
+#endif
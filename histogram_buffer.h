@@ -6,6 +6,7 @@
 
 #include "integral_transform.h"
 #include "diag.h"
+#include "saliency.h"
 
 using namespace cv;
 using namespace std;
@@ -13,63 +14,271 @@ using namespace std;
 #ifndef __HISTOGRAM_BUFFER_H__
 #define __HISTOGRAM_BUFFER_H__
 
+// the histograms of all cells of one size whose top left corners lie on a lattice, for every temporal cell of the
+// current window. patches of that cell size on the lattice are assembled from it instead of being queried one by one
+struct CellGrid
+{
+	int cellWidth, cellHeight;
+	int stepX, stepY;
+	Rect corners; // lattice of cell corners: x = corners.x + k*stepX < corners.x + corners.width, y likewise
+	int slices; // HistogramBuffer::slices it was built at
+	vector<Mat> histograms; // per temporal cell: a row per lattice row, nBins floats per lattice column
+
+	CellGrid() : cellWidth(0), cellHeight(0), stepX(1), stepY(1), slices(-1)
+	{
+	}
+
+	bool Covers(Rect rect, int nxCells, int nyCells) const
+	{
+		int w = rect.width/nxCells, h = rect.height/nyCells;
+		return w == cellWidth && h == cellHeight
+			&& rect.x >= corners.x && rect.y >= corners.y && (rect.x - corners.x) % stepX == 0 && (rect.y - corners.y) % stepY == 0
+			&& rect.x + (nxCells - 1)*w < corners.x + corners.width && rect.y + (nyCells - 1)*h < corners.y + corners.height
+			&& (w % stepX == 0 || nxCells == 1) && (h % stepY == 0 || nyCells == 1);
+	}
+
+	const float* Cell(int iT, int x, int y, int nBins) const
+	{
+		return histograms[iT].ptr<float>((y - corners.y) / stepY) + (x - corners.x) / stepX * nBins;
+	}
+};
+
+// temporal cells are made of slices of frames. each closed slice adds its integral transform to a running temporal
+// prefix sum, of which the last ntCells*slicesPerCell+1 are kept in a ring, so that any run of slices within the
+// window is a 3-D box that costs two integral transform lookups. the prefix sums are rebased on the oldest kept one
+// every time the ring has gone round, which keeps their magnitude (and float error) bounded at one subtraction per slice
 struct HistogramBuffer
 {
-	vector<pair<Mat, Mat > > currentStack;
-	vector<Mat> gluedIntegralTransforms;
+	vector<pair<Mat, Mat > > currentStack; // frames of the open slice, CV_32F or CV_16S whole-pixel flow (see UpdateQuantized)
+	vector<Mat> prefixRing; // slice k at k % size: integral transforms summed over the slices up to and including k
+	int slices; // slices closed so far
+	int slicesPerCell;
 	DescInfo descInfo;
 	int tStride;
 	int count;
-	Mat_<float> equDx, equDy;
+	Ptr<OrientationTable> orientationTable; // for the CV_16S entries
+	vector<CellGrid> cellGrids; // one per cell size, rebuilt when a slice has closed since
 
-	HistogramBuffer(DescInfo descInfo, int tStride) : 
+	HistogramBuffer(DescInfo descInfo, int tStride, int slicesPerCell) : 
 		descInfo(descInfo),
 		tStride(tStride),
+		slicesPerCell(slicesPerCell),
+		slices(0),
 		count(0)
 	{
-		gluedIntegralTransforms.resize(descInfo.ntCells);
+		prefixRing.resize(descInfo.ntCells*slicesPerCell + 1);
 	}
 
+	const Mat& PrefixAt(int slice) const
+	{
+		return prefixRing[slice % prefixRing.size()];
+	}
+
+	// integration is linear, so the histograms of the slice are summed first and integrated once, straight into the
+	// ring slot it takes over, and the previous prefix is added on top
 	void AddUpCurrentStack()
 	{
-		Mat cumulativeIntegralTransform;
-		for(int i = 0; i < currentStack.size(); i++)
+		Mat& prefix = prefixRing[slices % prefixRing.size()];
+		const Mat* previous = slices > 0 && !PrefixAt(slices - 1).empty() ? &PrefixAt(slices - 1) : NULL;
+		if(currentStack.empty())
 		{
-			Mat integralTransform = BuildOrientationIntegralTransform(descInfo, currentStack[i].first, currentStack[i].second);
-			if(i == 0)
-				cumulativeIntegralTransform = integralTransform;
+			if(previous)
+				previous->copyTo(prefix);
 			else
-				cumulativeIntegralTransform += integralTransform;
+				prefix = Mat();
+		}
+		else
+		{
+			Size sz = currentStack[0].first.size();
+			prefix.create(sz.height, sz.width*descInfo.nBins, CV_32F);
+			prefix.setTo(0);
+			for(int i = 0; i < currentStack.size(); i++)
+				AccumulateOrientationHistograms(descInfo, currentStack[i].first, currentStack[i].second, orientationTable, prefix);
+			IntegrateOrientationHistograms(prefix, descInfo.nBins);
+			if(previous && previous->size() == prefix.size())
+				prefix += *previous;
 		}
-
-		rotate(gluedIntegralTransforms.begin(), ++gluedIntegralTransforms.begin(), gluedIntegralTransforms.end());
-		gluedIntegralTransforms.back() = cumulativeIntegralTransform / tStride;
 		currentStack.clear();
+
+		slices++;
+		if(slices % prefixRing.size() == 0)
+			Rebase();
+	}
+
+	// subtracts the oldest kept prefix (which is only ever used as the start of a box) from all of them
+	void Rebase()
+	{
+		Mat base = PrefixAt(slices).clone();
+		if(base.empty())
+			return;
+		for(int k = 0; k < prefixRing.size(); k++)
+			if(prefixRing[k].size() == base.size())
+				prefixRing[k] -= base;
+	}
+
+	// end and start prefix of temporal cell iT of the window that ends with the last closed slice, end is empty when
+	// nothing has been added up yet
+	const Mat& TemporalCell(int iT, const Mat*& start)
+	{
+		int first = slices - descInfo.ntCells*slicesPerCell + iT*slicesPerCell;
+		start = first > 0 && !PrefixAt(first - 1).empty() ? &PrefixAt(first - 1) : NULL;
+		return PrefixAt(first + slicesPerCell - 1);
 	}
 
+	static int Gcd(int a, int b)
+	{
+		while(b != 0)
+		{
+			int r = a % b;
+			a = b;
+			b = r;
+		}
+		return a;
+	}
+
+	// builds (or keeps) the cell grid for patches of blockWidth x blockHeight placed every xStride, yStride within
+	// bounds. cells of neighbouring and overlapping patches, and of other patch sizes with the same cell size, are
+	// then summed once. the grid is built row by row, in the order of the transforms in memory
+	void PrepareCellGrid(int blockWidth, int blockHeight, int xStride, int yStride, Rect bounds)
+	{
+		int cellWidth = blockWidth/descInfo.nxCells, cellHeight = blockHeight/descInfo.nyCells;
+		if(cellWidth == 0 || cellHeight == 0)
+			return;
+		int stepX = Gcd(xStride, cellWidth), stepY = Gcd(yStride, cellHeight);
+		Rect corners(bounds.x, bounds.y, bounds.width - blockWidth + (descInfo.nxCells - 1)*cellWidth + 1,
+			bounds.height - blockHeight + (descInfo.nyCells - 1)*cellHeight + 1);
+
+		CellGrid* grid = NULL;
+		for(int k = 0; k < cellGrids.size() && grid == NULL; k++)
+			if(cellGrids[k].cellWidth == cellWidth && cellGrids[k].cellHeight == cellHeight)
+				grid = &cellGrids[k];
+		if(grid == NULL)
+		{
+			cellGrids.push_back(CellGrid());
+			grid = &cellGrids.back();
+		}
+		if(grid->slices == slices && grid->stepX == stepX && grid->stepY == stepY && grid->corners.x == corners.x
+			&& grid->corners.y == corners.y && grid->corners.width == corners.width && grid->corners.height == corners.height)
+			return;
+
+		grid->cellWidth = cellWidth;
+		grid->cellHeight = cellHeight;
+		grid->stepX = stepX;
+		grid->stepY = stepY;
+		grid->corners = corners;
+		grid->slices = slices;
+		grid->histograms.resize(descInfo.ntCells);
+
+		int cols = (corners.width + stepX - 1) / stepX, rows = (corners.height + stepY - 1) / stepY;
+		for(int iT = 0; iT < descInfo.ntCells; iT++)
+		{
+			const Mat* start;
+			const Mat& end = TemporalCell(iT, start);
+			if(end.empty())
+			{
+				grid->histograms[iT] = Mat();
+				continue;
+			}
+
+			grid->histograms[iT].create(rows, cols*descInfo.nBins, CV_32F);
+			for(int r = 0; r < rows; r++)
+			{
+				float* cell = grid->histograms[iT].ptr<float>(r);
+				for(int c = 0; c < cols; c++, cell += descInfo.nBins)
+					CellHistogram(end, start, descInfo.nBins, corners.x + c*stepX, corners.y + r*stepY, cellWidth, cellHeight,
+						1.0f / tStride, cell);
+			}
+		}
+	}
+
+	// the same descriptor as ComputeDescriptor, put together from a prepared cell grid
+	bool AssemblePatchDescriptor(Rect rect, float* res)
+	{
+		const CellGrid* grid = NULL;
+		for(int k = 0; k < cellGrids.size() && grid == NULL; k++)
+			if(cellGrids[k].slices == slices && cellGrids[k].Covers(rect, descInfo.nxCells, descInfo.nyCells))
+				grid = &cellGrids[k];
+		if(grid == NULL)
+			return false;
+
+		descInfo.ResetPatchDescriptorBuffer(res);
+		for(int iT = 0; iT < descInfo.ntCells; iT++)
+		{
+			if(grid->histograms[iT].empty())
+				continue;
+
+			float* desc = res + iT*descInfo.dim;
+			float* ptr_vec = desc;
+			for(int iX = 0; iX < descInfo.nxCells; iX++)
+			{
+				for(int iY = 0; iY < descInfo.nyCells; iY++)
+				{
+					const float* cell = grid->Cell(iT, rect.x + iX*grid->cellWidth, rect.y + iY*grid->cellHeight, descInfo.nBins);
+					for(int i = 0; i < descInfo.nBins; i++)
+						*ptr_vec++ = cell[i] + descriptorEpsilon;
+				}
+			}
+			Mat_<float> vec(1, descInfo.dim, desc, Mat::AUTO_STEP);
+			vec /= norm(vec, descInfo.norm);
+		}
+		return true;
+	}
+
+	// the temporal cells of the window that ends with the last closed slice
 	void QueryPatchDescriptor(Rect rect, float* res)
 	{
+		if(AssemblePatchDescriptor(rect, res))
+			return;
+
 		descInfo.ResetPatchDescriptorBuffer(res);
 		for(int iT = 0; iT < descInfo.ntCells; iT++)
-			ComputeDescriptor(gluedIntegralTransforms[iT], rect, descInfo, res + iT*descInfo.dim);
+		{
+			const Mat* start;
+			const Mat& end = TemporalCell(iT, start);
+			if(!end.empty())
+				ComputeDescriptor(end, rect, descInfo, res + iT*descInfo.dim, start, 1.0f / tStride);
+		}
 	}
 
 	void Update(Mat dx, Mat dy)
 	{
 		currentStack.push_back(make_pair(dx, dy));	
 	}
+
+	// for flow that is whole-pixel vectors times quantum: kept as int16 vectors, half the size, and binned by lookup
+	void UpdateQuantized(const Mat& dx, const Mat& dy, float quantum)
+	{
+		if(orientationTable.empty() || !orientationTable->Matches(descInfo, quantum))
+			orientationTable = new OrientationTable(descInfo, quantum);
+
+		Mat qx, qy;
+		dx.convertTo(qx, CV_16S, 1 / quantum);
+		dy.convertTo(qy, CV_16S, 1 / quantum);
+		currentStack.push_back(make_pair(qx, qy));
+	}
 };
 
 struct HofMbhBuffer
 {
 	Size frameSizeAfterInterpolation;
+	Point gridOrigin; // where the grid sits in the whole-frame grid, nonzero with a ROI
+	Size fullGridSize; // whole-frame grid, output coordinates are relative to it
 	bool print;
+	FILE* out;
 	bool AreDescriptorsReady;
 	vector<int> effectiveFrameIndices;
 	int tStride;
 	int ntCells;
+	int tStep; // source frames between two emitted windows, tStride for back-to-back cells
+	int sliceLength; // source frames per slice of the histogram buffers, gcd(tStride, tStep)
+	int framesInSlice; // source frames (sum of Frame::Span) accumulated in the open slice
+	int closedSlices;
 	double fScale;
+	Mat_<float> flowDx, flowDy; // flow summed over timeSkip+1 frames, shared by HOF and MBH
+	float flowQuantum; // Frame::FlowQuantum of the sum, 0 unless it is a single frame's uncompensated vectors
+	int flowCount;
 	double t;
+	MotionSaliency* saliency; // NULL when every patch is emitted
 	static const int timeSkip = 0;	// parameter for multi-skip
 
 	HistogramBuffer hog;
@@ -160,23 +369,33 @@ struct HofMbhBuffer
 		int tStride, 
 		Size frameSizeAfterInterpolation, 
 		double fScale, 
-		bool print = false)
+		bool print = false,
+		int tStep = 0)
 		: 
 		t(1.0),
+		saliency(NULL),
+		tStep(tStep > 0 ? tStep : tStride),
+		sliceLength(SliceLength(tStride, tStep)),
+		framesInSlice(0),
+		closedSlices(0),
+		flowCount(0),
+		flowQuantum(0),
 		frameSizeAfterInterpolation(frameSizeAfterInterpolation), 
+		fullGridSize(frameSizeAfterInterpolation),
 		ntCells(ntCells),
 		tStride(tStride),
 		fScale(fScale),
 		print(print),
+		out(stdout),
 
-		hof(hofInfo, tStride),
-		mbhX(mbhInfo, tStride),
-		mbhY(mbhInfo, tStride),
-		hog(hogInfo, tStride),
-        spatialVariance(spatialVarianceInfo, tStride),
-        dc(dcInfo, tStride),
-        verticalVariance(verticalVarianceInfo, tStride),
-        horizontalVariance(horizontalVarianceInfo, tStride),
+		hof(hofInfo, tStride, tStride / SliceLength(tStride, tStep)),
+		mbhX(mbhInfo, tStride, tStride / SliceLength(tStride, tStep)),
+		mbhY(mbhInfo, tStride, tStride / SliceLength(tStride, tStep)),
+		hog(hogInfo, tStride, tStride / SliceLength(tStride, tStep)),
+        spatialVariance(spatialVarianceInfo, tStride, tStride / SliceLength(tStride, tStep)),
+        dc(dcInfo, tStride, tStride / SliceLength(tStride, tStep)),
+        verticalVariance(verticalVarianceInfo, tStride, tStride / SliceLength(tStride, tStep)),
+        horizontalVariance(horizontalVarianceInfo, tStride, tStride / SliceLength(tStride, tStep)),
 
 		hog_patchDescriptor(NULL), 
 		hof_patchDescriptor(NULL),
@@ -200,57 +419,119 @@ struct HofMbhBuffer
                                          verticalVarianceInfo, horizontalVarianceInfo);
 	}
 
+	~HofMbhBuffer()
+	{
+		delete saliency;
+	}
+
+	static int SliceLength(int tStride, int tStep)
+	{
+		int a = tStride, b = tStep > 0 ? tStep : tStride;
+		while(b != 0)
+		{
+			int r = a % b;
+			a = b;
+			b = r;
+		}
+		return a;
+	}
+
+	int WindowSlices()
+	{
+		return ntCells * tStride / sliceLength;
+	}
+
+	// emit only patches whose motion saliency over the window is at least threshold, and at most topK of them per
+	// PrintFullDescriptor call (0 for no limit)
+	void EnablePruning(double threshold, int topK)
+	{
+		delete saliency;
+		saliency = new MotionSaliency(threshold, topK, WindowSlices());
+	}
+
+	// the frames only cover the part of the whole-frame grid of the given size that starts at origin
+	void SetRoi(Point origin, Size fullGrid)
+	{
+		gridOrigin = origin;
+		fullGridSize = fullGrid;
+	}
+
+	// an empty buffer with the same configuration, e.g. for a worker that processes another part of the video
+	HofMbhBuffer* CloneConfiguration()
+	{
+		HofMbhBuffer* res = new HofMbhBuffer(hogInfo, hofInfo, mbhInfo, spatialVarianceInfo, dcInfo, verticalVarianceInfo,
+			horizontalVarianceInfo, ntCells, tStride, frameSizeAfterInterpolation, fScale, print, tStep);
+		res->SetRoi(gridOrigin, fullGridSize);
+		if(saliency)
+			res->EnablePruning(saliency->Threshold, saliency->TopK);
+		return res;
+	}
+
+	// sums the flow of timeSkip+1 frames, returns true when the sum is complete. frames hand out their own flow Mats,
+	// which are only read, so the first frame of a sum is taken without a copy. the camera-motion-compensated flow is
+	// used when the frame has one
+	bool AccumulateFlow(Frame& frame)
+	{
+		const Mat_<float>& dx = frame.WarpDx.empty() ? frame.Dx : frame.WarpDx;
+		const Mat_<float>& dy = frame.WarpDy.empty() ? frame.Dy : frame.WarpDy;
+		if(flowCount == 0)
+		{
+			flowDx = dx;
+			flowDy = dy;
+			flowQuantum = frame.WarpDx.empty() ? frame.FlowQuantum : 0;
+		}
+		else
+		{
+			flowDx = flowDx + dx;
+			flowDy = flowDy + dy;
+			flowQuantum = 0;
+		}
+
+		flowCount++;
+		if(flowCount <= timeSkip)
+			return false;
+		flowCount = 0;
+		return true;
+	}
+
+	// source frames that were decoded but not passed to Update, the B-frames dropped before an I-frame. they still
+	// count towards the open slice (see CloseSlice), so that slices keep their length in source frames
+	void AddSkippedFrames(int count)
+	{
+		framesInSlice += count;
+	}
+
 	void Update(Frame& frame)
 	{
-		if(hofInfo.enabled)
+		bool flowReady = (hofInfo.enabled || mbhInfo.enabled) && AccumulateFlow(frame);
+
+		if(hofInfo.enabled && flowReady)
 		{
 			TIMERS.HofComputation.Start();
-			if(hof.count == 0)
-			{
-				hof.equDx = frame.Dx.clone();
-				hof.equDy = frame.Dy.clone();
-			}
+			if(flowQuantum > 0)
+				hof.UpdateQuantized(flowDx, flowDy, flowQuantum);
 			else
-			{
-				hof.equDx += frame.Dx;
-				hof.equDy += frame.Dy;
-			}
-			hof.count++;
-			if(hof.count > timeSkip)
-			{
-				hof.Update(hof.equDx, hof.equDy);
-				hof.count = 0;
-			}
+				hof.Update(flowDx, flowDy);
 			TIMERS.HofComputation.Stop();
 		}
 
-		if(mbhInfo.enabled)
+		if(mbhInfo.enabled && flowReady)
 		{
 			TIMERS.MbhComputation.Start();
-			if(mbhX.count == 0)
-			{
-				mbhX.equDx = frame.Dx.clone();
-				mbhX.equDy = frame.Dy.clone();
-			}
-			else
-			{
-				mbhX.equDx += frame.Dx;
-				mbhX.equDy += frame.Dy;
-			}
-			mbhX.count++;
-			if(mbhX.count > timeSkip)
-			{
-				Mat flowXdX, flowXdY, flowYdX, flowYdY;
-				Sobel(mbhX.equDx, flowXdX, CV_32F, 1, 0, 1);
-				Sobel(mbhX.equDx, flowXdY, CV_32F, 0, 1, 1);
-				Sobel(mbhX.equDy, flowYdX, CV_32F, 1, 0, 1);
-				Sobel(mbhX.equDy, flowYdY, CV_32F, 0, 1, 1);
-				mbhX.Update(flowXdX, flowXdY);
-				mbhY.Update(flowYdX, flowYdY);
-			}
+			Mat flowXdX, flowXdY, flowYdX, flowYdY;
+			Sobel(flowDx, flowXdX, CV_32F, 1, 0, 1);
+			Sobel(flowDx, flowXdY, CV_32F, 0, 1, 1);
+			Sobel(flowDy, flowYdX, CV_32F, 1, 0, 1);
+			Sobel(flowDy, flowYdY, CV_32F, 0, 1, 1);
+			mbhX.Update(flowXdX, flowXdY);
+			mbhY.Update(flowYdX, flowYdY);
 			TIMERS.MbhComputation.Stop();
 		}
 
+		if(saliency && !frame.Dx.empty())
+			saliency->Update(frame.WarpDx.empty() ? frame.Dx : frame.WarpDx, frame.WarpDy.empty() ? frame.Dy : frame.WarpDy,
+				frame.motionTextureMap);
+
 		if(hogInfo.enabled)
 		{
 			TIMERS.HogComputation.Start();
@@ -341,62 +622,80 @@ struct HofMbhBuffer
             TIMERS.HorizontalVarianceComputation.Stop();
         }
 
+		// temporal cells are measured in source frames, so that they keep their length when the reader drops frames.
+		// sums are still divided by tStride, fewer frames with longer motion vectors add up to the same displacement
 		effectiveFrameIndices.push_back(frame.PTS);
+		framesInSlice += frame.Span;
+	}
+
+	// closes the open slice once it holds sliceLength source frames, false when it doesn't yet. a frame (or an I-frame's
+	// dropped B-frames) can complete several slices, the ones after the first stay empty. so call it until it returns
+	// false, and check AreDescriptorsReady after every slice
+	bool CloseSlice()
+	{
 		AreDescriptorsReady = false;
-		if(effectiveFrameIndices.size() % tStride == 0)
+		if(framesInSlice < sliceLength)
+			return false;
+
+		framesInSlice -= sliceLength;
+
+		if(hofInfo.enabled)
 		{
-			if(hofInfo.enabled)
-			{
-				TIMERS.HofComputation.Start();
-				hof.AddUpCurrentStack();
-				TIMERS.HofComputation.Stop();
-			}
+			TIMERS.HofComputation.Start();
+			hof.AddUpCurrentStack();
+			TIMERS.HofComputation.Stop();
+		}
 
-			if(mbhInfo.enabled)
-			{
-				TIMERS.MbhComputation.Start();
-				mbhX.AddUpCurrentStack();
-				mbhY.AddUpCurrentStack();
-				TIMERS.MbhComputation.Stop();
-			}
+		if(mbhInfo.enabled)
+		{
+			TIMERS.MbhComputation.Start();
+			mbhX.AddUpCurrentStack();
+			mbhY.AddUpCurrentStack();
+			TIMERS.MbhComputation.Stop();
+		}
 
-			if(hogInfo.enabled)
-			{
-				TIMERS.HogComputation.Start();
-				hog.AddUpCurrentStack();
-				TIMERS.HogComputation.Stop();
-			}
+		if(hogInfo.enabled)
+		{
+			TIMERS.HogComputation.Start();
+			hog.AddUpCurrentStack();
+			TIMERS.HogComputation.Stop();
+		}
 
-            if(spatialVarianceInfo.enabled)
-            {
-                TIMERS.SpatialVarianceComputation.Start();
-                spatialVariance.AddUpCurrentStack();
-                TIMERS.SpatialVarianceComputation.Stop();
-            }
+        if(spatialVarianceInfo.enabled)
+        {
+            TIMERS.SpatialVarianceComputation.Start();
+            spatialVariance.AddUpCurrentStack();
+            TIMERS.SpatialVarianceComputation.Stop();
+        }
 
-            if(dcInfo.enabled)
-            {
-                TIMERS.DcComputation.Start();
-                dc.AddUpCurrentStack();
-                TIMERS.DcComputation.Stop();
-            }
+        if(dcInfo.enabled)
+        {
+            TIMERS.DcComputation.Start();
+            dc.AddUpCurrentStack();
+            TIMERS.DcComputation.Stop();
+        }
 
-            if(verticalVarianceInfo.enabled)
-            {
-                TIMERS.VerticalVarianceComputation.Start();
-                verticalVariance.AddUpCurrentStack();
-                TIMERS.VerticalVarianceComputation.Stop();
-            }
+        if(verticalVarianceInfo.enabled)
+        {
+            TIMERS.VerticalVarianceComputation.Start();
+            verticalVariance.AddUpCurrentStack();
+            TIMERS.VerticalVarianceComputation.Stop();
+        }
 
-            if(horizontalVarianceInfo.enabled)
-            {
-                TIMERS.HorizontalVarianceComputation.Start();
-                horizontalVariance.AddUpCurrentStack();
-                TIMERS.HorizontalVarianceComputation.Stop();
-            }
+        if(horizontalVarianceInfo.enabled)
+        {
+            TIMERS.HorizontalVarianceComputation.Start();
+            horizontalVariance.AddUpCurrentStack();
+            TIMERS.HorizontalVarianceComputation.Stop();
+        }
 
-			AreDescriptorsReady = effectiveFrameIndices.size() >= ntCells * tStride;
-		}
+		if(saliency)
+			saliency->CloseSlice();
+
+		// a window of ntCells cells ends with every slice, one is emitted every tStep frames
+		closedSlices++;
+		AreDescriptorsReady = closedSlices >= WindowSlices() && (closedSlices - WindowSlices()) % (tStep / sliceLength) == 0;
+		return true;
 	}
 
 	void PrintFileHeader()
@@ -428,11 +727,11 @@ struct HofMbhBuffer
 //			int(rect.height / fScale));
 
 
-		// Print the location of patch
-		Point patchCenter(rect.x + rect.width/2, rect.y + rect.height/2);
-		printf("%.2lf\t%.2lf\t%.2lf\t",
-		double(patchCenter.x) / frameSizeAfterInterpolation.width,
-		double(patchCenter.y) / frameSizeAfterInterpolation.height,
+		// Print the location of patch, in the whole frame
+		Point patchCenter(gridOrigin.x + rect.x + rect.width/2, gridOrigin.y + rect.y + rect.height/2);
+		fprintf(out, "%.2lf\t%.2lf\t%.2lf\t",
+		double(patchCenter.x) / fullGridSize.width,
+		double(patchCenter.y) / fullGridSize.height,
 		t / (frameCount/5));
 	}
 
@@ -488,24 +787,95 @@ struct HofMbhBuffer
 		{
 			TIMERS.Writing.Start();
 			PrintPatchDescriptorHeader(rect, frameCount);
-			PrintFloatArray(patchDescriptor);
+			PrintFloatArray(patchDescriptor, out);
 			
-			printf("\n");
+			fprintf(out, "\n");
 			TIMERS.Writing.Stop();
 			
 		}
 	}
 
+	// the cell histograms of all patches of one size, so that PrintPatchDescriptor only gathers and normalizes them
+	void PrepareCellGrids(int blockWidth, int blockHeight, int xStride, int yStride, Rect bounds)
+	{
+		TIMERS.DescriptorQuerying.Start();
+		if(hofInfo.enabled)
+		{
+			TIMERS.HofQuerying.Start();
+			hof.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.HofQuerying.Stop();
+		}
+		if(mbhInfo.enabled)
+		{
+			TIMERS.MbhQuerying.Start();
+			mbhX.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			mbhY.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.MbhQuerying.Stop();
+		}
+		if(hogInfo.enabled)
+		{
+			TIMERS.HogQuerying.Start();
+			hog.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.HogQuerying.Stop();
+		}
+		if(spatialVarianceInfo.enabled)
+		{
+			TIMERS.SpatialVarianceQuerying.Start();
+			spatialVariance.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.SpatialVarianceQuerying.Stop();
+		}
+		if(dcInfo.enabled)
+		{
+			TIMERS.DcQuerying.Start();
+			dc.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.DcQuerying.Stop();
+		}
+		if(verticalVarianceInfo.enabled)
+		{
+			TIMERS.VerticalVarianceQuerying.Start();
+			verticalVariance.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.VerticalVarianceQuerying.Stop();
+		}
+		if(horizontalVarianceInfo.enabled)
+		{
+			TIMERS.HorizontalVarianceQuerying.Start();
+			horizontalVariance.PrepareCellGrid(blockWidth, blockHeight, xStride, yStride, bounds);
+			TIMERS.HorizontalVarianceQuerying.Stop();
+		}
+		TIMERS.DescriptorQuerying.Stop();
+	}
+
 	void PrintFullDescriptor(int blockWidth, int blockHeight, int xStride, int yStride, int frameCount)
 	{
+		vector<Rect> patches;
 		for(int xOffset = 0; xOffset + blockWidth < frameSizeAfterInterpolation.width; xOffset += xStride)
 		{
 			for(int yOffset = 0; yOffset + blockHeight < frameSizeAfterInterpolation.height; yOffset += yStride)
 			{
-				Rect rect(xOffset, yOffset, blockWidth, blockHeight);
-				PrintPatchDescriptor(rect, frameCount);
+				patches.push_back(Rect(xOffset, yOffset, blockWidth, blockHeight));
 			}
 		}
+
+		if(saliency)
+			patches = saliency->Select(patches);
+		if(patches.empty())
+			return;
+
+		int right = 0, bottom = 0;
+		Rect bounds(patches[0].x, patches[0].y, 0, 0);
+		for(int k = 0; k < patches.size(); k++)
+		{
+			bounds.x = min(bounds.x, patches[k].x);
+			bounds.y = min(bounds.y, patches[k].y);
+			right = max(right, patches[k].x + patches[k].width);
+			bottom = max(bottom, patches[k].y + patches[k].height);
+		}
+		bounds.width = right - bounds.x;
+		bounds.height = bottom - bounds.y;
+		PrepareCellGrids(blockWidth, blockHeight, xStride, yStride, bounds);
+
+		for(int k = 0; k < patches.size(); k++)
+			PrintPatchDescriptor(patches[k], frameCount);
 	}
 };
 
@@ -1,9 +1,16 @@
 #include <cstdlib>
+#include <cfloat>
+#include <stdexcept>
+#include <vector>
 #include <opencv/cv.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 #include "desc_info.h"
 #include "common.h"
 using namespace cv;
+using namespace std;
 
 #ifndef __INTEGRAL_TRANSFORM_H__
 #define __INTEGRAL_TRANSFORM_H__
@@ -23,130 +30,380 @@ float FastSquareRootFloat(float number) {
     return number * y;
 }
 
-Mat BuildOrientationIntegralTransform(DescInfo descInfo, Mat_<float> dx, Mat_<float> dy)
+// per pixel of a row: the magnitude split between the two orientation bins around its angle. below the threshold
+// (when thresholding) all of the weight goes to the extra bin angleBins instead
+void SplitOrientations(const DescInfo& descInfo, const float* ptr_dx, const float* ptr_dy, int count,
+	int* bin0s, int* bin1s, float* m0s, float* m1s)
 {
-	Size sz = dx.size();
-	Mat dst(sz.height, sz.width*descInfo.nBins, CV_32F);
-	float* ptr_desc = dst.ptr<float>();
 	int angleBins = descInfo.applyThresholding ? descInfo.nBins - 1 : descInfo.nBins;
-
 	double fullAngle = descInfo.signedGradient ? 360 : 180;
 	float angleBase = fullAngle/double(angleBins);
-	
-	float* ptr_dx = dx.ptr<float>();
-	float* ptr_dy = dy.ptr<float>();
-	
-	vector<float> sum(descInfo.nBins);
-	
-	for(int i = 0, index = 0; i < sz.height; i++)
+
+	for(int j = 0; j < count; j++)
 	{
-		sum.assign(sum.size(), 0);
+		float shiftX = ptr_dx[j];
+		float shiftY = ptr_dy[j];
+		float m0 = sqrt(shiftX*shiftX+shiftY*shiftY);//FastSquareRootFloat(shiftX*shiftX + shiftY*shiftY);
+		float m1 = m0;
+
+		int bin0, bin1;
+		if(descInfo.applyThresholding && m0 <= descInfo.threshold)
+		{
+			bin0 = angleBins;
+			m0 = 1.0;
+			bin1 = 0;
+			m1 = 0;
+		}
+		else
+		{
+			float orientation = fastAtan2(shiftY, shiftX);
+			if(orientation > fullAngle)
+				orientation -= fullAngle;
+
+			float fbin = orientation/angleBase;
+			bin0 = cvFloor(fbin);
+			float weight0 = 1 - (fbin - bin0);
+			float weight1 = 1 - weight0;
+			bin0 %= angleBins;
+			bin1 = (bin0+1)%angleBins;
+
+			m0 *= weight0;
+			m1 *= weight1;
+		}
+
+		bin0s[j] = bin0;
+		bin1s[j] = bin1;
+		m0s[j] = m0;
+		m1s[j] = m1;
+	}
+}
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define INTEGRAL_TRANSFORM_AVX2
+#endif
+
+#ifdef INTEGRAL_TRANSFORM_AVX2
+// compiled for AVX2 whatever the -m flags, and only called when the CPU has it
+bool HasAvx2()
+{
+	static const bool res = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+	return res;
+}
+
+// SplitOrientations 8 pixels at a time. the angle is cv::fastAtan2 (OpenCV 2.x) evaluated with the same operations in
+// the same order and without FMA, and sqrt and division are exact in both, so the result is bit-identical
+__attribute__((target("avx2")))
+void SplitOrientationsAvx2(const DescInfo& descInfo, const float* ptr_dx, const float* ptr_dy, int count,
+	int* bin0s, int* bin1s, float* m0s, float* m1s)
+{
+	const int angleBins = descInfo.applyThresholding ? descInfo.nBins - 1 : descInfo.nBins;
+	const double fullAngle = descInfo.signedGradient ? 360 : 180;
+	const float angleBase = fullAngle/double(angleBins);
+
+	const float radToDeg = (float)(180/CV_PI);
+	const __m256 p1 = _mm256_set1_ps(0.9997878412794807f*radToDeg);
+	const __m256 p3 = _mm256_set1_ps(-0.3258083974640975f*radToDeg);
+	const __m256 p5 = _mm256_set1_ps(0.1555786518463281f*radToDeg);
+	const __m256 p7 = _mm256_set1_ps(-0.04432655554792128f*radToDeg);
+	const __m256 epsilon = _mm256_set1_ps((float)DBL_EPSILON);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 deg90 = _mm256_set1_ps(90.0f), deg180 = _mm256_set1_ps(180.0f), deg360 = _mm256_set1_ps(360.0f);
+	const __m256 full = _mm256_set1_ps((float)fullAngle);
+	const __m256 base = _mm256_set1_ps(angleBase);
+	const __m256 threshold = _mm256_set1_ps(descInfo.threshold);
+	const __m256i bins = _mm256_set1_epi32(angleBins);
+	const __m256i lastBin = _mm256_set1_epi32(angleBins - 1);
+	const __m256i oneBin = _mm256_set1_epi32(1);
+
+	int j = 0;
+	for(; j + 8 <= count; j += 8)
+	{
+		__m256 x = _mm256_loadu_ps(ptr_dx + j);
+		__m256 y = _mm256_loadu_ps(ptr_dy + j);
+		__m256 m = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+
+		// fastAtan2: the polynomial of the smaller over the larger of |x|, |y|, then unfolded into 0..360
+		__m256 ax = _mm256_andnot_ps(signMask, x);
+		__m256 ay = _mm256_andnot_ps(signMask, y);
+		__m256 xMajor = _mm256_cmp_ps(ax, ay, _CMP_GE_OQ);
+		__m256 c = _mm256_div_ps(_mm256_blendv_ps(ax, ay, xMajor), _mm256_add_ps(_mm256_blendv_ps(ay, ax, xMajor), epsilon));
+		__m256 c2 = _mm256_mul_ps(c, c);
+		__m256 a = _mm256_add_ps(_mm256_mul_ps(p7, c2), p5);
+		a = _mm256_add_ps(_mm256_mul_ps(a, c2), p3);
+		a = _mm256_add_ps(_mm256_mul_ps(a, c2), p1);
+		a = _mm256_mul_ps(a, c);
+		a = _mm256_blendv_ps(_mm256_sub_ps(deg90, a), a, xMajor);
+		a = _mm256_blendv_ps(a, _mm256_sub_ps(deg180, a), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+		a = _mm256_blendv_ps(a, _mm256_sub_ps(deg360, a), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+		a = _mm256_blendv_ps(a, _mm256_sub_ps(a, full), _mm256_cmp_ps(a, full, _CMP_GT_OQ));
+
+		__m256 fbin = _mm256_div_ps(a, base);
+		__m256 floorBin = _mm256_floor_ps(fbin);
+		__m256 weight0 = _mm256_sub_ps(one, _mm256_sub_ps(fbin, floorBin));
+		__m256 weight1 = _mm256_sub_ps(one, weight0);
+		__m256 m0 = _mm256_mul_ps(m, weight0);
+		__m256 m1 = _mm256_mul_ps(m, weight1);
 
-		for(int j = 0; j < sz.width; j++, index++)
+		// the angle is at most fullAngle, so the bin is at most angleBins and the modulo a single wrap
+		__m256i bin0 = _mm256_cvttps_epi32(floorBin);
+		bin0 = _mm256_sub_epi32(bin0, _mm256_and_si256(_mm256_cmpgt_epi32(bin0, lastBin), bins));
+		__m256i bin1 = _mm256_add_epi32(bin0, oneBin);
+		bin1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(bin1, bins), bin1);
+
+		if(descInfo.applyThresholding)
 		{
-			float shiftX = ptr_dx[index];
-			float shiftY = ptr_dy[index];
-			float m0 = sqrt(shiftX*shiftX+shiftY*shiftY);//FastSquareRootFloat(shiftX*shiftX + shiftY*shiftY);
-			float m1 = m0;
+			__m256 weak = _mm256_cmp_ps(m, threshold, _CMP_LE_OQ);
+			__m256i weakBins = _mm256_castps_si256(weak);
+			m0 = _mm256_blendv_ps(m0, one, weak);
+			m1 = _mm256_andnot_ps(weak, m1);
+			bin0 = _mm256_blendv_epi8(bin0, bins, weakBins);
+			bin1 = _mm256_andnot_si256(weakBins, bin1);
+		}
+
+		_mm256_storeu_si256((__m256i*)(bin0s + j), bin0);
+		_mm256_storeu_si256((__m256i*)(bin1s + j), bin1);
+		_mm256_storeu_ps(m0s + j, m0);
+		_mm256_storeu_ps(m1s + j, m1);
+	}
+
+	SplitOrientations(descInfo, ptr_dx + j, ptr_dy + j, count - j, bin0s + j, bin1s + j, m0s + j, m1s + j);
+}
+
+// dst += src over count floats
+__attribute__((target("avx2")))
+void AddRowAvx2(float* dst, const float* src, int count)
+{
+	int k = 0;
+	for(; k + 8 <= count; k += 8)
+		_mm256_storeu_ps(dst + k, _mm256_add_ps(_mm256_loadu_ps(dst + k), _mm256_loadu_ps(src + k)));
+	for(; k < count; k++)
+		dst[k] += src[k];
+}
+#endif
+
+// SplitOrientations of every whole-pixel vector (qx, qy) with |qx|, |qy| <= range, for a flow that is such vectors
+// times quantum (the reader's flow scale). motion vectors are small integers, so for them the split is a lookup
+struct OrientationTable
+{
+	static const int range = 64;
+	static const int side = 2*range + 1;
+
+	struct Entry
+	{
+		unsigned char bin0, bin1;
+		float m0, m1;
+	};
 
-			int bin0, bin1;
-			if(descInfo.applyThresholding && m0 <= descInfo.threshold)
+	DescInfo descInfo;
+	float quantum;
+	vector<Entry> entries;
+
+	// every entry is computed by SplitOrientations from (float)q * quantum, which is how the reader computes the flow,
+	// so a lookup gives exactly what the float path would
+	OrientationTable(const DescInfo& descInfo, float quantum) : descInfo(descInfo), quantum(quantum), entries(side*side)
+	{
+		vector<float> x(side), y(side);
+		vector<int> bin0s(side), bin1s(side);
+		vector<float> m0s(side), m1s(side);
+		for(int qy = -range; qy <= range; qy++)
+		{
+			for(int qx = -range; qx <= range; qx++)
 			{
-				bin0 = angleBins;
-				m0 = 1.0;
-				bin1 = 0;
-				m1 = 0;
+				x[qx + range] = qx * quantum;
+				y[qx + range] = qy * quantum;
 			}
-			else
+			SplitOrientations(descInfo, &x[0], &y[0], side, &bin0s[0], &bin1s[0], &m0s[0], &m1s[0]);
+			for(int k = 0; k < side; k++)
 			{
-				float orientation = fastAtan2(shiftY, shiftX);
-				if(orientation > fullAngle)
-					orientation -= fullAngle;
-
-				float fbin = orientation/angleBase;
-				bin0 = cvFloor(fbin);
-				float weight0 = 1 - (fbin - bin0);
-				float weight1 = 1 - weight0;
-				bin0 %= angleBins;
-				bin1 = (bin0+1)%angleBins;
-				//bin0 &= 7;
-				//bin1 = (bin0 + 1) & 7;
-
-				m0 *= weight0;
-				m1 *= weight1;
+				Entry& e = entries[(qy + range)*side + k];
+				e.bin0 = bin0s[k];
+				e.bin1 = bin1s[k];
+				e.m0 = m0s[k];
+				e.m1 = m1s[k];
 			}
+		}
+	}
 
-			sum[bin0] += m0;
-			sum[bin1] += m1;
+	bool Matches(const DescInfo& other, float otherQuantum) const
+	{
+		return quantum == otherQuantum && descInfo.nBins == other.nBins && descInfo.signedGradient == other.signedGradient
+			&& descInfo.applyThresholding == other.applyThresholding && descInfo.threshold == other.threshold;
+	}
 
-			int temp0 = index*descInfo.nBins;
-			if(i == 0)
+	// vectors beyond the table are split the usual way
+	void Split(const short* qx, const short* qy, int count, int* bin0s, int* bin1s, float* m0s, float* m1s) const
+	{
+		for(int j = 0; j < count; j++)
+		{
+			if(abs(qx[j]) <= range && abs(qy[j]) <= range)
 			{
-				for(int m = 0; m < descInfo.nBins; m++)
-					ptr_desc[temp0++] = sum[m];
+				const Entry& e = entries[(qy[j] + range)*side + qx[j] + range];
+				bin0s[j] = e.bin0;
+				bin1s[j] = e.bin1;
+				m0s[j] = e.m0;
+				m1s[j] = e.m1;
 			}
 			else
 			{
-				int temp1 = (index - sz.width)*descInfo.nBins;
-				for(int m = 0; m < descInfo.nBins; m++)
-				{
-					ptr_desc[temp0++] = ptr_desc[temp1++]+sum[m];
-				}
+				float x = qx[j] * quantum, y = qy[j] * quantum;
+				SplitOrientations(descInfo, &x, &y, 1, bin0s + j, bin1s + j, m0s + j, m1s + j);
 			}
 		}
 	}
-	return dst;
+};
+
+// adds the orientation histogram of every pixel of (dx, dy) into hist, which has nBins floats per pixel. each row is
+// split into bins and weights first, 8 pixels at a time with AVX2 or by table lookup for CV_16S whole-pixel flow
+void AccumulateOrientationHistograms(const DescInfo& descInfo, Mat dx, Mat dy, const OrientationTable* table, Mat& hist)
+{
+	Size sz = dx.size();
+	vector<int> bin0s(sz.width + 1), bin1s(sz.width + 1);
+	vector<float> m0s(sz.width + 1), m1s(sz.width + 1);
+#ifdef INTEGRAL_TRANSFORM_AVX2
+	bool avx2 = HasAvx2();
+#endif
+
+	for(int i = 0; i < sz.height; i++)
+	{
+		if(dx.type() == CV_16S)
+		{
+			if(table == NULL)
+				throw std::runtime_error("Whole-pixel flow needs an orientation table");
+			table->Split(dx.ptr<short>(i), dy.ptr<short>(i), sz.width, &bin0s[0], &bin1s[0], &m0s[0], &m1s[0]);
+		}
+#ifdef INTEGRAL_TRANSFORM_AVX2
+		else if(avx2)
+			SplitOrientationsAvx2(descInfo, dx.ptr<float>(i), dy.ptr<float>(i), sz.width, &bin0s[0], &bin1s[0], &m0s[0], &m1s[0]);
+#endif
+		else
+			SplitOrientations(descInfo, dx.ptr<float>(i), dy.ptr<float>(i), sz.width, &bin0s[0], &bin1s[0], &m0s[0], &m1s[0]);
+
+		float* ptr_hist = hist.ptr<float>(i);
+		for(int j = 0; j < sz.width; j++, ptr_hist += descInfo.nBins)
+		{
+			ptr_hist[bin0s[j]] += m0s[j];
+			ptr_hist[bin1s[j]] += m1s[j];
+		}
+	}
 }
 
-void ComputeDescriptor(Mat& integralTransform, Rect rect, DescInfo descInfo, float* desc)
+// turns per-pixel histograms into their integral transform in place: per bin, the sum over the pixels above and to
+// the left, inclusive. rows are prefix-summed first, then the row above is added to each
+void IntegrateOrientationHistograms(Mat& hist, int nBins)
 {
-	TIMERS.CallsComputeDescriptor++;
+	int rowLength = hist.cols;
+	vector<float> sum(nBins);
+#ifdef INTEGRAL_TRANSFORM_AVX2
+	bool avx2 = HasAvx2();
+#endif
 
-	const float epsilon = 0.05;
+	for(int i = 0; i < hist.rows; i++)
+	{
+		sum.assign(sum.size(), 0);
+		float* row = hist.ptr<float>(i);
+		for(int k = 0; k < rowLength; k += nBins)
+		{
+			for(int m = 0; m < nBins; m++)
+			{
+				sum[m] += row[k + m];
+				row[k + m] = sum[m];
+			}
+		}
 
-	int height = integralTransform.rows;
-	int width = integralTransform.cols / descInfo.nBins;
+		if(i == 0)
+			continue;
+		const float* above = hist.ptr<float>(i-1);
+#ifdef INTEGRAL_TRANSFORM_AVX2
+		if(avx2)
+			AddRowAvx2(row, above, rowLength);
+		else
+#endif
+			for(int k = 0; k < rowLength; k++)
+				row[k] += above[k];
+	}
+}
 
-	float* ptr_integralTransform = integralTransform.ptr<float>();
+Mat BuildOrientationIntegralTransform(DescInfo descInfo, Mat dx, Mat dy, const OrientationTable* table = NULL)
+{
+	Mat dst = Mat::zeros(dx.rows, dx.cols*descInfo.nBins, CV_32F);
+	AccumulateOrientationHistograms(descInfo, dx, dy, table, dst);
+	IntegrateOrientationHistograms(dst, descInfo.nBins);
+	return dst;
+}
 
-	Mat_<float> vec(1, descInfo.dim, desc, Mat::AUTO_STEP);
-	float* ptr_vec = desc;
-	int xOffset = rect.x;
-	int yOffset = rect.y;
-	int xStride = rect.width/descInfo.nxCells;
-	int yStride = rect.height/descInfo.nyCells;
+static const float descriptorEpsilon = 0.05;
 
-	for (int iX = 0, iDesc = 0; iX < descInfo.nxCells; ++iX)
-	for (int iY = 0; iY < descInfo.nyCells; ++iY)
-	{
-		int left = xOffset + iX*xStride - 1;
-		int right = std::min<int>(left + xStride + 1, width-1);
-		int top = yOffset + iY*yStride - 1;
-		int bottom = std::min<int>(top + yStride + 1, height-1);
+// the box sum ComputeDescriptor uses for the cell of cellWidth x cellHeight at (x, y), per bin and times scale. the box
+// reaches one row and column further than the cell, and is clamped to the transform
+void CellHistogram(const Mat& integralTransform, const Mat* startIntegralTransform, int nBins, int x, int y,
+	int cellWidth, int cellHeight, float scale, float* res)
+{
+	int height = integralTransform.rows;
+	int width = integralTransform.cols / nBins;
+
+	const float* ptr_integralTransform = integralTransform.ptr<float>();
+	const float* ptr_start = startIntegralTransform ? startIntegralTransform->ptr<float>() : NULL;
 
-		int TopLeft = (top*width+left)*descInfo.nBins;
-		int TopRight = (top*width+right)*descInfo.nBins;
-		int BottomLeft = (bottom*width+left)*descInfo.nBins;
-		int BottomRight = (bottom*width+right)*descInfo.nBins;
+	int left = x - 1;
+	int right = std::min<int>(left + cellWidth + 1, width-1);
+	int top = y - 1;
+	int bottom = std::min<int>(top + cellHeight + 1, height-1);
 
-		for (int i = 0; i < descInfo.nBins; ++i, ++iDesc) 
+	int TopLeft = (top*width+left)*nBins;
+	int TopRight = (top*width+right)*nBins;
+	int BottomLeft = (bottom*width+left)*nBins;
+	int BottomRight = (bottom*width+right)*nBins;
+
+	for (int i = 0; i < nBins; ++i) 
+	{
+		float sumTopLeft = 0, sumTopRight = 0, sumBottomLeft = 0, sumBottomRight = 0;
+		if (top >= 0)
 		{
-			float sumTopLeft = 0, sumTopRight = 0, sumBottomLeft = 0, sumBottomRight = 0;
-			if (top >= 0)
-			{
-				if (left >= 0)
-					sumTopLeft = ptr_integralTransform[TopLeft+i];
-				
-				sumTopRight = ptr_integralTransform[TopRight+i];
-			}
-			
 			if (left >= 0)
-				sumBottomLeft = ptr_integralTransform[BottomLeft+i];
+				sumTopLeft = ptr_integralTransform[TopLeft+i];
 			
-			sumBottomRight = ptr_integralTransform[BottomRight+i];
+			sumTopRight = ptr_integralTransform[TopRight+i];
+		}
+		
+		if (left >= 0)
+			sumBottomLeft = ptr_integralTransform[BottomLeft+i];
+		
+		sumBottomRight = ptr_integralTransform[BottomRight+i];
 
-			ptr_vec[iDesc] = epsilon + sumBottomRight + sumTopLeft - sumBottomLeft - sumTopRight;
+		float box = sumBottomRight + sumTopLeft - sumBottomLeft - sumTopRight;
+		if (ptr_start)
+		{
+			float startTopLeft = top >= 0 && left >= 0 ? ptr_start[TopLeft+i] : 0;
+			float startTopRight = top >= 0 ? ptr_start[TopRight+i] : 0;
+			float startBottomLeft = left >= 0 ? ptr_start[BottomLeft+i] : 0;
+			box -= ptr_start[BottomRight+i] + startTopLeft - startBottomLeft - startTopRight;
 		}
+
+		res[i] = box*scale;
+	}
+}
+
+// the descriptor of rect from the integral transform end, or from the difference end - start of two temporal prefix
+// sums of integral transforms (see HistogramBuffer), times scale
+void ComputeDescriptor(const Mat& integralTransform, Rect rect, DescInfo descInfo, float* desc, const Mat* startIntegralTransform = NULL,
+	float scale = 1)
+{
+	TIMERS.CallsComputeDescriptor++;
+
+	Mat_<float> vec(1, descInfo.dim, desc, Mat::AUTO_STEP);
+	float* ptr_vec = desc;
+	int xStride = rect.width/descInfo.nxCells;
+	int yStride = rect.height/descInfo.nyCells;
+
+	for (int iX = 0; iX < descInfo.nxCells; ++iX)
+	for (int iY = 0; iY < descInfo.nyCells; ++iY, ptr_vec += descInfo.nBins)
+	{
+		CellHistogram(integralTransform, startIntegralTransform, descInfo.nBins, rect.x + iX*xStride, rect.y + iY*yStride,
+			xStride, yStride, scale, ptr_vec);
+		for (int i = 0; i < descInfo.nBins; ++i)
+			ptr_vec[i] += descriptorEpsilon;
 	}
 
 	//normalize(vec, vec, 1, 0, descInfo.norm);
@@ -12,6 +12,11 @@
 #include "options.h"
 #include "diag.h"
 #include "rbh.h"
+#include "decode_ahead.h"
+#include "extraction.h"
+#include "feature_cache.h"
+#include "motion_vector_dump.h"
+#include "feature_graph.h"
 
 #include <iterator>
 #include <vector>
@@ -54,8 +59,38 @@ int main(int argc, char* argv[])
     DescInfo verticalVarianceInfo(8, false, nt_cell, opts.VerticalVarianceEnabled);
     DescInfo horizontalVarianceInfo(8, false, nt_cell, opts.HorizontalVarianceEnabled);
 
+	double fscale = 1 / 8.0;
+
 	TIMERS.Reading.Start();
-    FrameReader rdr(opts.VideoPath, hogInfo.enabled);
+    FeatureGraph graph(opts, hogInfo, hofInfo, mbhInfo, spatialVarianceInfo, dcInfo, verticalVarianceInfo, horizontalVarianceInfo);
+    graph.Explain();
+    bool hogFromDc = graph.DcImage;
+    FrameReaderSettings readerSettings(graph.Pixels);
+    readerSettings.MemoryMappedInput = opts.MemoryMappedInput;
+    readerSettings.FastDecode = opts.FastDecode;
+    readerSettings.DropNonReferenceFrames = opts.DropNonReferenceFrames;
+    readerSettings.ReadMotionVectors = graph.MotionVectors;
+    readerSettings.ReadDctCoefficients = graph.DctCoefficients;
+    readerSettings.PictureDctCoefficients = opts.PictureDct;
+    // with interpolation the reader fills the 8x8 block grid itself, flow is scaled on the way in either way
+    readerSettings.NativeFlowGrid = opts.Interpolation;
+    readerSettings.FlowScale = fscale;
+	if(opts.HasRoi)
+		readerSettings.Roi = Rect(opts.RoiX, opts.RoiY, opts.RoiWidth, opts.RoiHeight);
+	// a replayed feature cache stands in for the decoder, with whatever flow grid and scale it was written with.
+	// motion vector dumps follow -interpolation like the decoder does
+	FrameSource* source;
+	FrameReader* rdr = NULL;
+	if(opts.ReplayPath != "")
+	{
+		if(hogInfo.enabled && !hogFromDc)
+			throw std::runtime_error("Feature caches hold no pixels, replaying needs -hogsource dc or -hog no");
+		source = new FeatureCacheReader(opts.ReplayPath);
+	}
+	else if(opts.MotionVectorDumpPath != "")
+		source = new MotionVectorDumpReader(opts.MotionVectorDumpPath, opts.Interpolation, fscale);
+	else
+		source = rdr = new FrameReader(opts.VideoPath, readerSettings);
 	TIMERS.Reading.Stop();
 
 //    VideoCapture videoCapture(opts.VideoPath);
@@ -64,68 +99,69 @@ int main(int argc, char* argv[])
 //    frameNum -= 3;
 //    int frameIndex = 1;
 
-	Size frameSizeAfterInterpolation = 
-		opts.Interpolation
-			? Size(2*rdr.DownsampledFrameSize.width - 1, 2*rdr.DownsampledFrameSize.height - 1)
-			: rdr.DownsampledFrameSize;
-	int cellSize = rdr.OriginalFrameSize.width / frameSizeAfterInterpolation.width;
-	double fscale = 1 / 8.0;
+	Size frameSizeAfterInterpolation = source->FlowGridSize;
+	int cellSize = source->flowGridStep;
 
-	log("Frame count:\t%d", rdr.FrameCount);
-	log("Original frame size:\t%dx%d", rdr.OriginalFrameSize.width, rdr.OriginalFrameSize.height);
-	log("Downsampled:\t%dx%d", rdr.DownsampledFrameSize.width, rdr.DownsampledFrameSize.height);
+	log("Frame count:\t%d", source->FrameCount);
+	log("Original frame size:\t%dx%d", source->OriginalFrameSize.width, source->OriginalFrameSize.height);
+	log("Downsampled:\t%dx%d", source->DownsampledFrameSize.width, source->DownsampledFrameSize.height);
     log("After interpolation:\t%dx%d", frameSizeAfterInterpolation.width, frameSizeAfterInterpolation.height);
+	log("ROI:\t%dx%d at %d,%d", source->Roi.width, source->Roi.height, source->Roi.x, source->Roi.y);
 	log("CellSize:\t%d", cellSize);
+	if(rdr)
+		log("Fast decode:\t%s", yesno(rdr->FastDecoding));
+	if(rdr && graph.DctCoefficients && rdr->NoCodecDctCoefficients)
+	{
+		if(opts.PictureDct)
+			log("Warning: H.264 input, the DCT channels come from a DCT of the decoded picture. in P/B-frames they describe texture and not the prediction residual, so they aren't comparable to MPEG-4 ones");
+		else
+			log("Warning: H.264 input has no DCT coefficients, the DCT channels stay empty (-picturedct yes computes them from the picture)");
+	}
+
+	if(rdr && hogInfo.enabled && opts.HogInput == HogFromLuma)
+		rdr->ReadLumaImagesAt(frameSizeAfterInterpolation);
 
     HofMbhBuffer buffer(hogInfo, hofInfo, mbhInfo, spatialVarianceInfo, dcInfo, verticalVarianceInfo, horizontalVarianceInfo,
-                        nt_cell, tStride, frameSizeAfterInterpolation, fscale, true);
+                        nt_cell, tStride, frameSizeAfterInterpolation, fscale, true, opts.TemporalStep);
     buffer.PrintFileHeader();
-
-    Rbh rbh;
+	buffer.SetRoi(Point(source->Roi.x / cellSize, source->Roi.y / cellSize),
+		Size(source->OriginalFrameSize.width / cellSize, source->OriginalFrameSize.height / cellSize));
+	if(opts.PruningEnabled())
+		buffer.EnablePruning(opts.SaliencyThreshold, opts.TopK);
+
+	ExtractionSettings extraction;
+	extraction.frameSizeAfterInterpolation = frameSizeAfterInterpolation;
+	extraction.cellSize = cellSize;
+	extraction.frameCount = source->FrameCount;
+	extraction.patchSizes = patchSizes;
+	extraction.dense = opts.Dense;
+	extraction.trackDcImage = hogFromDc;
+	extraction.rbhMaps = graph.RbhMaps;
+	extraction.compensateCameraMotion = opts.CompensateCameraMotion && graph.Flow;
+	extraction.decodeAheadDepth = opts.DecodeAheadDepth;
+	extraction.cache = opts.CachePath != "" ? new FeatureCacheWriter(opts.CachePath, *source) : NULL;
+
+	int64_t firstPts = opts.HasPtsRange ? opts.FirstPts : minPts;
+	int64_t lastPts = opts.HasPtsRange ? opts.LastPts : maxPts;
 
 	TIMERS.Everything.Start();
-	while(true)
+	if(opts.Shards > 1 && rdr)
+	{
+		ExtractDescriptorsSharded(*rdr, opts.VideoPath, readerSettings, buffer, extraction, opts.Shards, firstPts, lastPts);
+	}
+	else
 	{
-//        if(frameIndex > frameNum)
-//            break;
-        Frame frame = rdr.Read();
-//        videoCapture.operator >>(cap);
-        if(frame.PTS == -1 /*|| cap.empty()*/)
-			break;
-//        frame.RawImage = cap.clone();
-//        ++frameIndex;
-
-		log("#read frame pts=%d, mvs=%s, type=%c", frame.PTS, frame.NoMotionVectors ? "no" : "yes", frame.PictType);
-
-		if(opts.GoodPts.empty() || count(opts.GoodPts.begin(), opts.GoodPts.end(), frame.PTS) == 1)
-		{
-			TIMERS.DescriptorComputation.Start();
-			
-            if(frame.NoMotionVectors || frame.RawImage.empty())
-			{
-				TIMERS.SkippedFrames++;
-				continue;
-			}
-
-            rbh.Update(frame);
-            frame.Interpolate(frameSizeAfterInterpolation, fscale);
-            buffer.Update(frame);
-			TIMERS.DescriptorComputation.Stop();
-		
-            if(buffer.AreDescriptorsReady)
-            {
-                for(int k = 0; k < patchSizes.size(); k++)
-                {
-                    int blockWidth = patchSizes[k].width / cellSize;
-                    int blockHeight = patchSizes[k].height / cellSize;
-                    int xStride = opts.Dense ? 1 : blockWidth / 2;
-                    int yStride = opts.Dense ? 1 : blockHeight / 2;
-                    buffer.PrintFullDescriptor(blockWidth, blockHeight, xStride, yStride, rdr.FrameCount);
-                }
-                buffer.t++;
-            }
-		}
+		// start from the keyframe before the range instead of decoding the whole video up to it
+		if(opts.HasPtsRange && !source->SeekToPts(opts.FirstPts))
+			log("Seeking to pts=%d failed, decoding from the start", opts.FirstPts);
+
+		Rbh rbh(hogFromDc);
+		DecodeAheadReader decodeAhead(*source, opts.DecodeAheadDepth);
+		ExtractDescriptors(decodeAhead, rbh, buffer, extraction, firstPts, firstPts, lastPts);
 	}
     TIMERS.Everything.Stop();
-	TIMERS.Print(rdr.FrameCount);
+	TIMERS.Print(source->FrameCount);
+
+	delete extraction.cache;
+	delete source;
  }
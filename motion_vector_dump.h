@@ -0,0 +1,261 @@
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "diag.h"
+#include "log.h"
+#include "frame_reader.h"
+#include "motion_vector_file_utils.h"
+#include <opencv/cv.h>
+
+using namespace std;
+using namespace cv;
+
+#ifndef __MOTION_VECTOR_DUMP_H__
+#define __MOTION_VECTOR_DUMP_H__
+
+// one line of a MotionVectorFileWriter dump, without the fields nothing reads
+struct DumpedMotionVector
+{
+	int X, Y;
+	float Dx, Dy;
+	char SegmCode;
+};
+
+struct DumpedFrame
+{
+	int FrameIndex;
+	int FirstVector, VectorCount; // range in the vectors of the chunk the frame was parsed from
+};
+
+// a piece of the dump that starts and ends at a frame index boundary, parsed on its own thread
+struct DumpChunk
+{
+	const char* begin;
+	const char* end;
+	vector<DumpedMotionVector> vectors;
+	vector<DumpedFrame> frames;
+	pthread_t thread;
+
+	static bool IsBlank(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	// the dumps only hold integers and %.2f numbers, which is all this handles
+	static double ParseNumber(const char*& p, const char* end)
+	{
+		while(p < end && IsBlank(*p))
+			p++;
+		bool negative = p < end && *p == '-';
+		if(negative || (p < end && *p == '+'))
+			p++;
+
+		double res = 0;
+		while(p < end && *p >= '0' && *p <= '9')
+			res = res*10 + (*p++ - '0');
+		if(p < end && *p == '.')
+		{
+			p++;
+			double scale = 0.1;
+			for(; p < end && *p >= '0' && *p <= '9'; scale *= 0.1)
+				res += (*p++ - '0') * scale;
+		}
+		return negative ? -res : res;
+	}
+
+	static const char* NextLine(const char* p, const char* end)
+	{
+		while(p < end && *p != '\n')
+			p++;
+		return p < end ? p + 1 : end;
+	}
+
+	static int FrameIndexOf(const char* line, const char* end)
+	{
+		return (int)ParseNumber(line, end);
+	}
+
+	// FrameIndex X Y Dx Dy Mx My TypeSegm, see MotionVectorFileWriter::Write
+	void Parse()
+	{
+		for(const char* p = begin; p < end; p = NextLine(p, end))
+		{
+			if(*p == '\n')
+				continue;
+
+			const char* q = p;
+			int frameIndex = (int)ParseNumber(q, end);
+			DumpedMotionVector v;
+			v.X = (int)ParseNumber(q, end);
+			v.Y = (int)ParseNumber(q, end);
+			v.Dx = ParseNumber(q, end);
+			v.Dy = ParseNumber(q, end);
+			ParseNumber(q, end);
+			ParseNumber(q, end);
+			if(q < end && *q == '\t')
+				q++;
+			// the segmentation code may itself be a blank, so it is taken as is
+			v.SegmCode = q + 1 < end && q[1] != '\n' ? q[1] : '?';
+
+			if(frames.empty() || frames.back().FrameIndex != frameIndex)
+			{
+				DumpedFrame frame = {frameIndex, (int)vectors.size(), 0};
+				frames.push_back(frame);
+			}
+			vectors.push_back(v);
+			frames.back().VectorCount++;
+		}
+	}
+
+	static void* Run(void* arg)
+	{
+		((DumpChunk*)arg)->Parse();
+		return NULL;
+	}
+};
+
+// replays a MotionVectorFileWriter text dump as Frames with Dx/Dy/Missing, for HOF and MBH only. the dump is mapped and
+// parsed up front, in parallel chunks split at frame index boundaries; each Read() then rasterises one frame.
+// dumps carry no frame size, pts or picture types: the size is taken from the largest vector position, the frame index
+// stands in for the pts and every frame counts as a P-frame
+struct MotionVectorDumpReader : FrameSource
+{
+	MappedInputFile mapping;
+	vector<DumpChunk> chunks;
+	int chunk, frameInChunk;
+	float flowScale;
+
+	MotionVectorDumpReader(string path, bool nativeFlowGrid, double flowScale)
+		: chunk(0), frameInChunk(0), flowScale(flowScale)
+	{
+		TIMERS.Reading.Start();
+		mapping.Open(path);
+		const char* begin = (const char*)mapping.data;
+		const char* end = begin + mapping.size;
+		// header line
+		if(begin < end && !(*begin >= '0' && *begin <= '9'))
+			begin = DumpChunk::NextLine(begin, end);
+		TIMERS.Reading.Stop();
+
+		TIMERS.ReadingAndDecoding.Start();
+		int nChunks = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+		vector<const char*> bounds(1, begin);
+		for(int k = 1; k < nChunks; k++)
+		{
+			const char* p = max(bounds.back(), DumpChunk::NextLine(begin + (end - begin) * k / nChunks - 1, end));
+			if(p < end)
+			{
+				int frameIndex = DumpChunk::FrameIndexOf(p, end);
+				while(p < end && DumpChunk::FrameIndexOf(p, end) == frameIndex)
+					p = DumpChunk::NextLine(p, end);
+			}
+			bounds.push_back(p);
+		}
+		bounds.push_back(end);
+
+		chunks.resize(nChunks);
+		for(int k = 0; k < nChunks; k++)
+		{
+			chunks[k].begin = bounds[k];
+			chunks[k].end = bounds[k+1];
+			if(pthread_create(&chunks[k].thread, NULL, DumpChunk::Run, &chunks[k]) != 0)
+				throw std::runtime_error("Couldn't start dump parsing thread");
+		}
+
+		int maxX = 0, maxY = 0;
+		FrameCount = 0;
+		for(int k = 0; k < nChunks; k++)
+		{
+			pthread_join(chunks[k].thread, NULL);
+			FrameCount += chunks[k].frames.size();
+			for(int i = 0; i < chunks[k].vectors.size(); i++)
+			{
+				maxX = max(maxX, chunks[k].vectors[i].X);
+				maxY = max(maxY, chunks[k].vectors[i].Y);
+			}
+		}
+		TIMERS.ReadingAndDecoding.Stop();
+
+		const int gridStep = FrameReader::gridStep;
+		OriginalFrameSize = Size((maxX / gridStep + 1) * gridStep, (maxY / gridStep + 1) * gridStep);
+		DownsampledFrameSize = Size(OriginalFrameSize.width / gridStep, OriginalFrameSize.height / gridStep);
+		flowGridStep = nativeFlowGrid ? gridStep / 2 : gridStep;
+		FlowGridSize = Size(OriginalFrameSize.width / flowGridStep, OriginalFrameSize.height / flowGridStep);
+		Roi = Rect(0, 0, OriginalFrameSize.width, OriginalFrameSize.height);
+		ptsPerFrame = 1;
+	}
+
+	// partition size and texture for a segmentation code, as in FrameReader::ReadMotionVectors
+	static void Partition(char segmCode, int& w, int& h, float& texture)
+	{
+		w = segmCode == '+' || segmCode == '|' ? 8 : 16;
+		h = segmCode == '+' || segmCode == '-' ? 8 : 16;
+		texture = segmCode == '+' ? 16.0f : segmCode == '-' || segmCode == '|' ? 8.0f : 4.0f;
+	}
+
+	Frame Read()
+	{
+		while(chunk < chunks.size() && frameInChunk >= chunks[chunk].frames.size())
+		{
+			chunk++;
+			frameInChunk = 0;
+		}
+		if(chunk >= chunks.size())
+			return Frame::Null(-1);
+
+		TIMERS.ReadingAndDecoding.Start();
+		const DumpChunk& c = chunks[chunk];
+		const DumpedFrame& dumped = c.frames[frameInChunk++];
+
+		Frame res(dumped.FrameIndex, Mat_<float>::zeros(FlowGridSize), Mat_<float>::zeros(FlowGridSize), Mat_<bool>::zeros(FlowGridSize));
+		res.motionTextureMap = Mat::zeros(FlowGridSize, CV_32FC1);
+		res.PTS = dumped.FrameIndex;
+		res.PictType = 'P';
+
+		for(int k = dumped.FirstVector; k < dumped.FirstVector + dumped.VectorCount; k++)
+		{
+			const DumpedMotionVector& v = c.vectors[k];
+			int w, h;
+			float texture;
+			Partition(v.SegmCode, w, h, texture);
+
+			MotionVector mv;
+			mv.Dx = v.Dx;
+			mv.Dy = v.Dy;
+			bool missing = mv.NoMotionVector();
+
+			Rect cells = FlowCellsOfBlock(v.X, v.Y, w, h);
+			for(int i = cells.y; i < cells.y + cells.height; i++)
+			{
+				for(int j = cells.x; j < cells.x + cells.width; j++)
+				{
+					if(missing)
+						res.Missing(i, j) = true;
+					else
+					{
+						res.Dx(i, j) = v.Dx * flowScale;
+						res.Dy(i, j) = v.Dy * flowScale;
+					}
+					res.motionTextureMap.at<float>(i, j) = texture;
+				}
+			}
+		}
+		TIMERS.ReadingAndDecoding.Stop();
+		return res;
+	}
+
+	bool SeekToPts(int64_t pts)
+	{
+		for(chunk = 0; chunk < chunks.size(); chunk++)
+			for(frameInChunk = 0; frameInChunk < chunks[chunk].frames.size(); frameInChunk++)
+				if(chunks[chunk].frames[frameInChunk].FrameIndex >= pts)
+					return true;
+		return true;
+	}
+};
+
+#endif
@@ -27,20 +27,58 @@ const char* yesno(bool b)
 	return b ? yes : no;
 }
 
+enum HogSource
+{
+	HogFromBgr,		// full-resolution BGR conversion, then resized and converted to gray on every frame
+	HogFromLuma,	// luma plane scaled by the reader straight to the interpolated grid
+	HogFromDc		// DC-coefficient thumbnail from Rbh, no pixel conversion at all
+};
+
+static const char* hogSourceNames[] = {"bgr", "luma", "dc"};
+
 struct Options
 {
 	string VideoPath;
     bool HogEnabled, HofEnabled, MbhEnabled, SpatialVarianceEnabled, DcEnabled, VerticalVarianceEnabled, HorizontalVarianceEnabled;
 	bool Dense;
 	bool Interpolation;
+	int DecodeAheadDepth;
+	bool MemoryMappedInput;
+	bool FastDecode;
+	bool DropNonReferenceFrames;
+	bool PictureDct; // DCT channels of H.264 input from a DCT of the picture, not comparable to MPEG-4 ones
+	int Shards;
+	bool CompensateCameraMotion;
+	double SaliencyThreshold; // patches with less motion are not emitted, 0 emits all
+	int TopK; // most salient patches emitted per patch size and window, 0 emits all
+	int TemporalStep; // frames between emitted windows, 0 for one window per temporal cell
+	string CachePath; // feature cache to write while extracting
+	string ReplayPath; // feature cache to read instead of decoding VideoPath
+	string MotionVectorDumpPath; // MotionVectorFileWriter text dump to read instead of decoding VideoPath
+	HogSource HogInput;
+
+	bool HasRoi;
+	int RoiX, RoiY, RoiWidth, RoiHeight; // pixels, grown to whole macroblocks by the reader
+
+	bool HasPtsRange;
+	int FirstPts, LastPts;
+
+	bool PruningEnabled()
+	{
+		return SaliencyThreshold > 0 || TopK > 0;
+	}
 
-	vector<int> GoodPts;
+	bool InPtsRange(int64_t pts)
+	{
+		return !HasPtsRange || (FirstPts <= pts && pts <= LastPts);
+	}
 
 	void Explain()
 	{
         log("Options:");
         log("Input video: %s", VideoPath.c_str());
         log("HOG's enabled: %s", yesno(HogEnabled));
+        log("HOG source: %s", hogSourceNames[HogInput]);
         log("HOF's enabled: %s", yesno(HofEnabled));
         log("MBH's enabled: %s", yesno(MbhEnabled));
         log("SpatialVariance's enabled: %s", yesno(SpatialVarianceEnabled));
@@ -50,12 +88,39 @@ struct Options
 
         log("Dense-dense-revolution: %s", yesno(Dense));
         log("Interpolation: %s", yesno(Interpolation));
-		fprintf(stderr, "Good PTS: ");
-		for(int i = 0; i < GoodPts.size(); i++)
-			fprintf(stderr, "%d, ", GoodPts[i]);
-		log(stderr, "");
+        log("Decode-ahead depth: %d", DecodeAheadDepth);
+        log("Memory-mapped input: %s", yesno(MemoryMappedInput));
+        log("Fast decode (when no pixels are needed): %s", yesno(FastDecode));
+        log("Drop non-reference B-frames: %s", yesno(DropNonReferenceFrames));
+        log("DCT of the picture for H.264: %s", yesno(PictureDct));
+        log("GOP shards: %d", Shards);
+        log("Camera motion compensation: %s", yesno(CompensateCameraMotion));
+        log("Saliency threshold (flow grid cells per frame, 0 is off): %.3lf", SaliencyThreshold);
+        log("Top-K salient patches (0 is all): %d", TopK);
+        log("Temporal step (frames between windows, 0 is one per cell): %d", TemporalStep);
+        log("Feature cache to write: %s", CachePath != "" ? CachePath.c_str() : "none");
+        log("Feature cache to replay: %s", ReplayPath != "" ? ReplayPath.c_str() : "none");
+        log("Motion vector dump to replay: %s", MotionVectorDumpPath != "" ? MotionVectorDumpPath.c_str() : "none");
+		if(HasRoi)
+			log("ROI: %dx%d at %d,%d", RoiWidth, RoiHeight, RoiX, RoiY);
+		else
+			log("ROI: whole frame");
+		if(HasPtsRange)
+			log("Good PTS: %d-%d", FirstPts, LastPts);
+		else
+			log("Good PTS: all");
 	}
 	
+	HogSource ParseHogSource(const char* name)
+	{
+		for(int i = 0; i < sizeof(hogSourceNames) / sizeof(hogSourceNames[0]); i++)
+			if(strcmp(name, hogSourceNames[i]) == 0)
+				return (HogSource)i;
+
+		printf("Unknown HOG source: %s", name);
+		exit(0);
+	}
+
 	void ParseCommandLine(int argc, char* argv[])
 	{
 		for(int i = 1; i < argc-1; i += 2)
@@ -80,12 +145,39 @@ struct Options
 				Dense = strcmp(argv[i+1], yes) == 0;
 			else if(strcmp(argv[i], "-interpolation") == 0)
 				Interpolation = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-hogsource") == 0)
+				HogInput = ParseHogSource(argv[i+1]);
+			else if(strcmp(argv[i], "-decodeahead") == 0)
+				DecodeAheadDepth = atoi(argv[i+1]);
+			else if(strcmp(argv[i], "-mmap") == 0)
+				MemoryMappedInput = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-fastdecode") == 0)
+				FastDecode = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-dropb") == 0)
+				DropNonReferenceFrames = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-picturedct") == 0)
+				PictureDct = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-shards") == 0)
+				Shards = atoi(argv[i+1]);
+			else if(strcmp(argv[i], "-camera") == 0)
+				CompensateCameraMotion = strcmp(argv[i+1], yes) == 0;
+			else if(strcmp(argv[i], "-saliency") == 0)
+				SaliencyThreshold = atof(argv[i+1]);
+			else if(strcmp(argv[i], "-topk") == 0)
+				TopK = atoi(argv[i+1]);
+			else if(strcmp(argv[i], "-tstep") == 0)
+				TemporalStep = atoi(argv[i+1]);
+			else if(strcmp(argv[i], "-cache") == 0)
+				CachePath = string(argv[i+1]);
+			else if(strcmp(argv[i], "-replay") == 0)
+				ReplayPath = string(argv[i+1]);
+			else if(strcmp(argv[i], "-mvdump") == 0)
+				MotionVectorDumpPath = string(argv[i+1]);
+			else if(strcmp(argv[i], "-roi") == 0)
+				HasRoi = sscanf(argv[i+1], "%d,%d,%d,%d", &RoiX, &RoiY, &RoiWidth, &RoiHeight) == 4;
 			else if(strcmp(argv[i], "-f") == 0)
 			{
-				int b, e;
-				sscanf(argv[i+1], "%d-%d", &b, &e);
-				for(int i = b; i <= e; i++)
-					GoodPts.push_back(i);
+				HasPtsRange = sscanf(argv[i+1], "%d-%d", &FirstPts, &LastPts) == 2;
 			}
 			else
 			{
@@ -93,6 +185,10 @@ struct Options
 				exit(0);
 			}
 		}
+
+		// motion vector dumps have neither pixels nor DCT coefficients
+		if(MotionVectorDumpPath != "")
+			HogEnabled = SpatialVarianceEnabled = DcEnabled = VerticalVarianceEnabled = HorizontalVarianceEnabled = false;
 	}
 
 	void SetDefaults()
@@ -107,11 +203,34 @@ struct Options
 
 		Dense = false;
         Interpolation = true;
+        DecodeAheadDepth = 0;
+        MemoryMappedInput = false;
+        FastDecode = true;
+        DropNonReferenceFrames = false;
+        PictureDct = false;
+        HasPtsRange = false;
+        HasRoi = false;
+        Shards = 1;
+        CompensateCameraMotion = false;
+        SaliencyThreshold = 0;
+        TopK = 0;
+        TemporalStep = 0;
+        HogInput = HogFromBgr;
 	}
 
 	void Check()
 	{
-		AssertFileExists(VideoPath, "video path");
+		if(ReplayPath != "")
+			AssertFileExists(ReplayPath, "feature cache to replay");
+		else if(MotionVectorDumpPath != "")
+			AssertFileExists(MotionVectorDumpPath, "motion vector dump to replay");
+		else
+			AssertFileExists(VideoPath, "video path");
+		if(CachePath != "" && Shards > 1)
+			throw std::runtime_error("-cache can't be combined with -shards");
+		// caches and dumps don't record where their grid sits in the frame
+		if(HasRoi && (CachePath != "" || ReplayPath != "" || MotionVectorDumpPath != ""))
+			throw std::runtime_error("-roi can't be combined with -cache, -replay or -mvdump");
 	}
 
 	void SetDebugDefaults()
@@ -7,75 +7,133 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv/cv.h>
+#include <cstdlib>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct Rbh
 {
     static const int dctGridStep = 8;
-    Mat spatialVarianceMap;
-    Mat dcMap;
-    Mat verticalVarianceMap;
-    Mat horizontalVarianceMap;
+    bool TrackDcImage;
+    Mat dcImage;
 
-    void Update(Frame& frame)
+    Rbh(bool trackDcImage = false) : TrackDcImage(trackDcImage)
     {
-        if(frame.dctMap.empty())
-        	return;
+    }
 
-        spatialVarianceMap = Mat::zeros(frame.RawImage.rows/dctGridStep, frame.RawImage.cols/dctGridStep, CV_32FC1);
-        dcMap = Mat::zeros(frame.RawImage.rows/dctGridStep, frame.RawImage.cols/dctGridStep, CV_32FC1);
-        verticalVarianceMap = Mat::zeros(frame.RawImage.rows/dctGridStep, frame.RawImage.cols/dctGridStep, CV_32FC1);
-        horizontalVarianceMap = Mat::zeros(frame.RawImage.rows/dctGridStep, frame.RawImage.cols/dctGridStep, CV_32FC1);
+    // keeps a 1/8-scale luma thumbnail built from DC coefficients. intra blocks carry the (scaled) block mean directly,
+    // inter blocks only the DC of the prediction residual, which is added to the thumbnail of the last reference frame
+    // (zero-motion approximation). B-frames are not used as references, so they get a thumbnail but don't update it.
+    void UpdateDcImage(Frame& frame)
+    {
+        if(frame.dcMap.empty())
+            return;
 
-        // spatial variance
-        for(int blk_j = 0; blk_j < frame.RawImage.rows/dctGridStep; ++blk_j)
+        if(frame.PictType == 'I' || frame.DctOfPicture || dcImage.size() != frame.dcMap.size())
         {
-            for(int blk_i = 0; blk_i < frame.RawImage.cols/dctGridStep; ++blk_i)
-            {
-                float sum = 0;
-                for(int j = 1; j < dctGridStep; ++j)
-                    for(int i = 1; i < dctGridStep; ++i)
-                        sum += abs(frame.dctMap.at<float>(blk_j*dctGridStep+j, blk_i*dctGridStep+i));
-                spatialVarianceMap.at<float>(blk_j, blk_i) = sum/(dctGridStep*dctGridStep);
-            }
+            dcImage = frame.dcMap.clone();
+            frame.dcImage = dcImage.clone();
+            return;
         }
 
-        // dc
-        for(int blk_j = 0; blk_j < frame.RawImage.rows/dctGridStep; ++blk_j)
+        // in P-frames a macroblock is missing a motion vector only when it is intra-coded
+        bool knowsIntra = frame.PictType == 'P' && !frame.Missing.empty();
+        Mat current(dcImage.size(), CV_32FC1);
+        for(int blk_j = 0; blk_j < current.rows; ++blk_j)
         {
-            for(int blk_i = 0; blk_i < frame.RawImage.cols/dctGridStep; ++blk_i)
+            for(int blk_i = 0; blk_i < current.cols; ++blk_i)
             {
-                dcMap.at<float>(blk_j, blk_i) = frame.dctMap.at<float>(blk_j*dctGridStep+0, blk_i*dctGridStep+0);
+                float dc = frame.dcMap.at<float>(blk_j, blk_i);
+                bool intra = knowsIntra && frame.Missing(blk_j*frame.Missing.rows/current.rows, blk_i*frame.Missing.cols/current.cols);
+                current.at<float>(blk_j, blk_i) = intra ? dc : dcImage.at<float>(blk_j, blk_i) + dc;
             }
         }
 
-        // vertical variance
-        for(int blk_j = 0; blk_j < frame.RawImage.rows/dctGridStep; ++blk_j)
+        if(frame.PictType != 'B')
+            dcImage = current.clone();
+        frame.dcImage = current;
+    }
+
+    // reads an 8x8 block once for all four maps: the absolute sums of rows 1-7 (everything but the first row), of the
+    // AC coefficients of the first row and of the first column below the DC. the spatial variance is the first minus
+    // the last, so the sums are exact integers like in the scalar loops they replace
+    static void AbsSums(const short* block, int& sumAc, int& sumFirstRow, int& sumFirstColumn)
+    {
+        sumFirstColumn = 0;
+        for(int j = 1; j < dctGridStep; ++j)
+            sumFirstColumn += abs(block[j*dctGridStep]);
+
+#ifdef __SSE2__
+        // madd with the per-lane sign (+1/-1) gives |a|+|b| of neighbouring lanes in 32 bits, exact even for -32768
+        const __m128i one = _mm_set1_epi16(1);
+        __m128i row = _mm_loadu_si128((const __m128i*)block);
+        __m128i firstRow = _mm_madd_epi16(row, _mm_or_si128(_mm_srai_epi16(row, 15), one));
+        __m128i rest = _mm_setzero_si128();
+        for(int j = 1; j < dctGridStep; ++j)
         {
-            for(int blk_i = 0; blk_i < frame.RawImage.cols/dctGridStep; ++blk_i)
-            {
-                float sum = 0;
-                for(int j = 1; j < dctGridStep; ++j)
-                    sum += abs(frame.dctMap.at<float>(blk_j*dctGridStep+j, blk_i*dctGridStep+0));
-                verticalVarianceMap.at<float>(blk_j, blk_i) = sum/(dctGridStep-1);
-            }
+            row = _mm_loadu_si128((const __m128i*)(block + j*dctGridStep));
+            rest = _mm_add_epi32(rest, _mm_madd_epi16(row, _mm_or_si128(_mm_srai_epi16(row, 15), one)));
         }
+        sumFirstRow = HorizontalSum(firstRow) - abs(block[0]);
+        sumAc = HorizontalSum(rest);
+#else
+        sumFirstRow = 0;
+        for(int i = 1; i < dctGridStep; ++i)
+            sumFirstRow += abs(block[i]);
+        sumAc = 0;
+        for(int k = dctGridStep; k < dctGridStep*dctGridStep; ++k)
+            sumAc += abs(block[k]);
+#endif
+    }
+
+#ifdef __SSE2__
+    static int HorizontalSum(__m128i v)
+    {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+    }
+#endif
+
+    void Update(Frame& frame)
+    {
+        const DctCoefficientView& dct = frame.dctCoefficients;
+        if(dct.empty())
+        {
+            // frames replayed from a feature cache come with the maps, but the thumbnail is still ours to keep
+            if(TrackDcImage)
+                UpdateDcImage(frame);
+            return;
+        }
+
+        // every map is freshly allocated: frames (and their maps) are kept around by the histogram buffer
+        const Size blocks = dct.BlockGridSize;
+        frame.spatialVarianceMap.create(blocks, CV_32FC1);
+        frame.dcMap.create(blocks, CV_32FC1);
+        frame.verticalVarianceMap.create(blocks, CV_32FC1);
+        frame.horizontalVarianceMap.create(blocks, CV_32FC1);
 
-        // horizontal variance
-        for(int blk_j = 0; blk_j < frame.RawImage.rows/dctGridStep; ++blk_j)
+        for(int blk_j = 0; blk_j < blocks.height; ++blk_j)
         {
-            for(int blk_i = 0; blk_i < frame.RawImage.cols/dctGridStep; ++blk_i)
+            float* spatial = frame.spatialVarianceMap.ptr<float>(blk_j);
+            float* dc = frame.dcMap.ptr<float>(blk_j);
+            float* vertical = frame.verticalVarianceMap.ptr<float>(blk_j);
+            float* horizontal = frame.horizontalVarianceMap.ptr<float>(blk_j);
+            for(int blk_i = 0; blk_i < blocks.width; ++blk_i)
             {
-                float sum = 0;
-                for(int i = 1; i < dctGridStep; ++i)
-                    sum += abs(frame.dctMap.at<float>(blk_j*dctGridStep+0, blk_i*dctGridStep+i));
-                horizontalVarianceMap.at<float>(blk_j, blk_i) = sum/(dctGridStep-1);
+                const short* block = dct.Block(blk_j, blk_i);
+                int sumAc, sumFirstRow, sumFirstColumn;
+                AbsSums(block, sumAc, sumFirstRow, sumFirstColumn);
+                spatial[blk_i] = float(sumAc - sumFirstColumn)/(dctGridStep*dctGridStep);
+                dc[blk_i] = block[0];
+                vertical[blk_i] = float(sumFirstColumn)/(dctGridStep-1);
+                horizontal[blk_i] = float(sumFirstRow)/(dctGridStep-1);
             }
         }
 
-        frame.spatialVarianceMap = spatialVarianceMap.clone();
-        frame.dcMap = dcMap.clone();
-        frame.verticalVarianceMap = verticalVarianceMap.clone();
-        frame.horizontalVarianceMap = horizontalVarianceMap.clone();
+        if(TrackDcImage)
+            UpdateDcImage(frame);
     }
 };
 
@@ -0,0 +1,121 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "common.h"
+#include "diag.h"
+#include <opencv/cv.h>
+
+using namespace std;
+using namespace cv;
+
+#ifndef __SALIENCY_H__
+#define __SALIENCY_H__
+
+// motion saliency of the patches of the current temporal window, used to skip static patches before they are
+// queried. a grid cell's saliency is its flow magnitude (in flow grid cells per frame) weighted by the partition
+// texture relative to a whole-macroblock vector (1 for 16x16 up to 4 for 8x8), averaged over the frames of a slice
+// (see HistogramBuffer) and then over the slices of the window. a patch scores the mean saliency of its cells
+struct MotionSaliency
+{
+	double Threshold; // patches scoring below this are skipped, 0 keeps all
+	int TopK; // at most this many patches per patch size and window, 0 for no limit
+	int windowSlices;
+
+	Mat_<float> current; // sum over the frames of the open slice
+	int framesInCurrent;
+	vector<Mat_<float> > closedSlices;
+	Mat_<double> windowIntegral;
+
+	MotionSaliency(double threshold, int topK, int windowSlices)
+		: Threshold(threshold), TopK(topK), windowSlices(windowSlices), framesInCurrent(0)
+	{
+	}
+
+	void Update(const Mat_<float>& dx, const Mat_<float>& dy, const Mat& motionTexture)
+	{
+		TIMERS.SaliencyPruning.Start();
+		if(current.size() != dx.size())
+			current = Mat_<float>::zeros(dx.size());
+
+		Mat texture;
+		if(motionTexture.size() == dx.size())
+			texture = motionTexture;
+		else if(!motionTexture.empty())
+			resize(motionTexture, texture, dx.size(), 0, 0, INTER_NEAREST);
+
+		for(int i = 0; i < dx.rows; i++)
+		{
+			const float* x = dx[i];
+			const float* y = dy[i];
+			const float* tex = texture.empty() ? NULL : texture.ptr<float>(i);
+			float* sum = current[i];
+			for(int j = 0; j < dx.cols; j++)
+				sum[j] += sqrt(x[j]*x[j] + y[j]*y[j]) * (tex ? max(tex[j], 4.0f) / 4.0f : 1.0f);
+		}
+		framesInCurrent++;
+		TIMERS.SaliencyPruning.Stop();
+	}
+
+	void CloseSlice()
+	{
+		if(current.empty())
+			return;
+
+		TIMERS.SaliencyPruning.Start();
+		closedSlices.push_back(framesInCurrent > 0 ? Mat_<float>(current / framesInCurrent) : current.clone());
+		if(closedSlices.size() > windowSlices)
+			closedSlices.erase(closedSlices.begin());
+		current = Mat_<float>::zeros(current.size());
+		framesInCurrent = 0;
+
+		Mat_<float> window = closedSlices[0].clone();
+		for(int k = 1; k < closedSlices.size(); k++)
+			window += closedSlices[k];
+		window /= (float)closedSlices.size();
+		integral(window, windowIntegral, CV_64F);
+		TIMERS.SaliencyPruning.Stop();
+	}
+
+	double Score(Rect rect)
+	{
+		double sum = windowIntegral(rect.y + rect.height, rect.x + rect.width) - windowIntegral(rect.y, rect.x + rect.width)
+			- windowIntegral(rect.y + rect.height, rect.x) + windowIntegral(rect.y, rect.x);
+		return sum / rect.area();
+	}
+
+	// the patches to query, in their original order. all of them while no cell has been closed with motion vectors
+	vector<Rect> Select(const vector<Rect>& patches)
+	{
+		if(windowIntegral.empty())
+			return patches;
+
+		TIMERS.SaliencyPruning.Start();
+		vector<pair<double, int> > scored;
+		for(int k = 0; k < patches.size(); k++)
+		{
+			double score = Score(patches[k]);
+			if(score >= Threshold)
+				scored.push_back(make_pair(-score, k));
+		}
+		if(TopK > 0 && scored.size() > TopK)
+		{
+			nth_element(scored.begin(), scored.begin() + TopK, scored.end());
+			scored.resize(TopK);
+		}
+
+		vector<int> kept;
+		for(int k = 0; k < scored.size(); k++)
+			kept.push_back(scored[k].second);
+		sort(kept.begin(), kept.end());
+
+		vector<Rect> res;
+		for(int k = 0; k < kept.size(); k++)
+			res.push_back(patches[kept[k]]);
+		TIMERS.PrunedPatches += patches.size() - res.size();
+		TIMERS.SaliencyPruning.Stop();
+		return res;
+	}
+};
+
+#endif
@@ -1,35 +1,46 @@
 #include <ctime>
+#include <time.h>
 
 #ifndef __TIMING_H__
 #define __TIMING_H__
 
+// by default the CPU time of the calling thread, so that work overlapped on other threads (decode-ahead, shards) isn't
+// counted twice. Timer(CLOCK_MONOTONIC) measures wall-clock time
 struct Timer
 {
-	clock_t before;
-	clock_t total;
+	clockid_t clock;
+	double before;
+	double total;
+
+	Timer(clockid_t clock = CLOCK_THREAD_CPUTIME_ID) : clock(clock), before(0), total(0) {}
+
+	double Now()
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
 
-	Timer() : before(0), total(0) {}
 	void Start()
 	{
-		before = clock();
+		before = Now();
 	}
 
 	void Stop()
 	{
-		total += clock() - before;
+		total += Now() - before;
 	}
 
 	double TotalInSeconds()
 	{
-		return double(total) / CLOCKS_PER_SEC;
+		return total;
 	}
 
 	double TotalInMilliseconds()
 	{
-		double CLOCKS_PER_MSEC = CLOCKS_PER_SEC / 1000.0;
-		return double(total) / CLOCKS_PER_MSEC;
+		return total * 1000;
 	}
 };
 
 
-#endif
\ No newline at end of file
+#endif